@@ -1,15 +1,29 @@
 #include <sstream>
 #include "PGDBConnection.hpp"
 
+struct RC2::PGDBConnection::AsyncQuery {
+	const PreparedQuery *prepared; //or nullptr to send query
+	std::string query;
+	std::vector<std::string> params;
+	std::vector<int> paramFormats;
+	int resultFormat;
+	AsyncResultHandler handler;
+	PGresult *lastResult;
+	bool sent;
+};
 
 RC2::PGDBConnection::PGDBConnection()
-	: dbcon_(nullptr)
+	: dbcon_(nullptr), eventBase_(nullptr), socketEvent_(nullptr)
 {
 
 }
 
 RC2::PGDBConnection::~PGDBConnection()
 {
+	if (socketEvent_)
+		event_free(socketEvent_);
+	for (auto &query : asyncQueries_)
+		PQclear(query->lastResult);
 	if (dbcon_) {
 		PQfinish(dbcon_);
 	}
@@ -30,11 +44,13 @@ void RC2::PGDBConnection::connect ( std::string connectStr ) {
 
 DBResult RC2::PGDBConnection::executeQuery ( std::string query )
 {
+	finishAsync();
 	return DBResult(PQexec(dbcon_, query.c_str()));
 }
 
 long int RC2::PGDBConnection::longFromQuery ( std::string query )
 {
+	finishAsync();
 	long value = 0;
 	DBResult res(PQexec(dbcon_, query.c_str()));
 	if (res.dataReturned()) {
@@ -50,9 +66,131 @@ DBResult RC2::PGDBConnection::executeQuery ( std::string query, int numParams,
 											 const int* paramLengths, const int* paramFormats, 
 											 int resultFormat )
 {
+	finishAsync();
 	return DBResult(PQexecParams(dbcon_, query.c_str(), numParams, paramTypes, paramValues, paramLengths, paramFormats, resultFormat));
 }
 
+void RC2::PGDBConnection::prepare ( const PreparedQuery &stmt )
+{
+	if (preparedNames_.count(stmt.name) > 0)
+		return;
+	DBResult res(PQprepare(dbcon_, stmt.name, stmt.query, stmt.numParams, NULL));
+	if (!res.commandOK()) {
+		std::ostringstream errorBuffer;
+		errorBuffer << "failed to prepare " << stmt.name << ": " << res.errorMessage();
+		throw DBException(errorBuffer.str());
+	}
+	preparedNames_.insert(stmt.name);
+}
+
+DBResult RC2::PGDBConnection::executePrepared ( const PreparedQuery &stmt, const char*const* paramValues, 
+												const int* paramLengths, const int* paramFormats, 
+												int resultFormat )
+{
+	finishAsync();
+	prepare(stmt);
+	return DBResult(PQexecPrepared(dbcon_, stmt.name, stmt.numParams, paramValues, paramLengths, 
+		paramFormats, resultFormat));
+}
+
+long int RC2::PGDBConnection::longFromPrepared ( const PreparedQuery &stmt, const char*const* paramValues )
+{
+	DBResult res(executePrepared(stmt, paramValues, NULL, NULL, 0));
+	if (!res.dataReturned())
+		throw DBException(res.errorMessage());
+	return atol(res.getValue(0, 0));
+}
+
+std::vector<DBResult> RC2::PGDBConnection::executePipeline ( const std::vector<PipelineStep> &steps )
+{
+	finishAsync();
+	for (auto &step : steps)
+		prepare(*step.stmt);
+	std::vector<DBResult> results;
+#ifdef LIBPQ_HAS_PIPELINING
+	if (PQenterPipelineMode(dbcon_) != 1)
+		throw DBException("failed to enter pipeline mode");
+	size_t numSent = 0;
+	for (auto &step : steps) {
+		if (PQsendQueryPrepared(dbcon_, step.stmt->name, step.stmt->numParams, step.paramValues, 
+			step.paramLengths, step.paramFormats, 0) != 1)
+		{
+			break;
+		}
+		numSent++;
+	}
+	std::string sendError = numSent < steps.size() ? PQerrorMessage(dbcon_) : "";
+	PQpipelineSync(dbcon_);
+	for (size_t i=0; i < numSent; i++) {
+		results.emplace_back(PQgetResult(dbcon_));
+		PGresult *extra;
+		while ((extra = PQgetResult(dbcon_)) != NULL) //the NULL that ends each statement
+			PQclear(extra);
+	}
+	PQclear(PQgetResult(dbcon_)); //PGRES_PIPELINE_SYNC
+	PQexitPipelineMode(dbcon_);
+	if (!sendError.empty())
+		throw DBException("failed to send pipeline: " + sendError);
+#else
+	//one round trip per statement, in a transaction so they still succeed or fail together
+	bool ownTransaction = PQtransactionStatus(dbcon_) == PQTRANS_IDLE;
+	if (ownTransaction)
+		DBResult(dbcon_, "begin");
+	bool failed = false;
+	for (auto &step : steps) {
+		if (failed) {
+			results.emplace_back(PQmakeEmptyPGresult(dbcon_, PGRES_FATAL_ERROR));
+			continue;
+		}
+		results.emplace_back(PQexecPrepared(dbcon_, step.stmt->name, step.stmt->numParams, 
+			step.paramValues, step.paramLengths, step.paramFormats, 0));
+		ExecStatusType status = PQresultStatus(results.back());
+		failed = status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK;
+	}
+	if (ownTransaction)
+		DBResult(dbcon_, failed ? "rollback" : "commit");
+#endif
+	return results;
+}
+
+bool RC2::PGDBConnection::streamQuery ( std::string query, std::function<void (DBResult&)> rowHandler, 
+										 std::string &errorMessage, int resultFormat )
+{
+	finishAsync();
+	if (PQsendQueryParams(dbcon_, query.c_str(), 0, NULL, NULL, NULL, NULL, resultFormat) != 1) {
+		errorMessage = PQerrorMessage(dbcon_);
+		return false;
+	}
+	if (PQsetSingleRowMode(dbcon_) != 1)
+		errorMessage = "failed to set single row mode";
+	bool success = errorMessage.empty();
+	//results must be read until NULL even after an error
+	PGresult *pgres;
+	while ((pgres = PQgetResult(dbcon_)) != NULL) {
+		DBResult res(pgres);
+		switch (PQresultStatus(pgres)) {
+			case PGRES_SINGLE_TUPLE:
+				if (!success)
+					break;
+				try {
+					rowHandler(res);
+				} catch (std::exception &e) {
+					errorMessage = e.what();
+					success = false;
+				}
+				break;
+			case PGRES_TUPLES_OK: //end of rows
+				break;
+			default:
+				if (success)
+					errorMessage = res.errorMessage();
+				success = false;
+				break;
+		}
+	}
+	return success;
+}
+
 bool RC2::PGDBConnection::checkForNotification(std::string& channel, std::string& parameter)
 {
 	PGnotify *notify;
@@ -65,3 +203,145 @@ bool RC2::PGDBConnection::checkForNotification(std::string& channel, std::string
 	}
 	return false;
 }
+
+void RC2::PGDBConnection::sendQuery ( std::string query, std::vector<std::string> params, 
+									   std::vector<int> paramFormats, AsyncResultHandler handler, 
+									   int resultFormat )
+{
+	auto asyncQuery = std::make_shared<AsyncQuery>();
+	asyncQuery->prepared = nullptr;
+	asyncQuery->query = query;
+	asyncQuery->params = params;
+	asyncQuery->paramFormats = paramFormats;
+	asyncQuery->resultFormat = resultFormat;
+	asyncQuery->handler = handler;
+	asyncQuery->lastResult = nullptr;
+	asyncQuery->sent = false;
+	queueQuery(asyncQuery);
+}
+
+void RC2::PGDBConnection::sendPrepared ( const PreparedQuery &stmt, std::vector<std::string> params, 
+										  std::vector<int> paramFormats, AsyncResultHandler handler, 
+										  int resultFormat )
+{
+	auto asyncQuery = std::make_shared<AsyncQuery>();
+	asyncQuery->prepared = &stmt;
+	asyncQuery->params = params;
+	asyncQuery->paramFormats = paramFormats;
+	asyncQuery->resultFormat = resultFormat;
+	asyncQuery->handler = handler;
+	asyncQuery->lastResult = nullptr;
+	asyncQuery->sent = false;
+	queueQuery(asyncQuery);
+}
+
+void RC2::PGDBConnection::queueQuery ( std::shared_ptr<AsyncQuery> asyncQuery )
+{
+	asyncQueries_.push_back(asyncQuery);
+	if (eventBase_ == nullptr) {
+		finishAsync();
+	} else if (asyncQueries_.size() == 1) {
+		sendNextQuery();
+		processAsyncResults(false);
+	}
+}
+
+void RC2::PGDBConnection::finishAsync()
+{
+	if (asyncQueries_.empty())
+		return;
+	if (socketEvent_)
+		event_del(socketEvent_);
+	processAsyncResults(true);
+}
+
+//sends the query at the front of the queue if it hasn't been. Ones that fail to send
+// are finished with an error result
+void RC2::PGDBConnection::sendNextQuery()
+{
+	while (!asyncQueries_.empty() && !asyncQueries_.front()->sent) {
+		auto query = asyncQueries_.front();
+		std::vector<const char*> values;
+		std::vector<int> lengths;
+		for (auto &param : query->params) {
+			values.push_back(param.data());
+			lengths.push_back(param.length());
+		}
+		query->paramFormats.resize(query->params.size(), 0);
+		int sent = 0;
+		if (query->prepared) {
+			try {
+				prepare(*query->prepared); //nothing else is in progress, so this can block
+				//so large parameters don't block while being written to the socket
+				PQsetnonblocking(dbcon_, 1);
+				sent = PQsendQueryPrepared(dbcon_, query->prepared->name, values.size(), values.data(), 
+					lengths.data(), query->paramFormats.data(), query->resultFormat);
+			} catch (DBException &e) {
+				sent = 0;
+			}
+		} else {
+			PQsetnonblocking(dbcon_, 1);
+			sent = PQsendQueryParams(dbcon_, query->query.c_str(), values.size(), NULL, values.data(), 
+				lengths.data(), query->paramFormats.data(), query->resultFormat);
+		}
+		if (sent == 1) {
+			query->sent = true;
+			return;
+		}
+		asyncQueries_.pop_front();
+		DBResult res(PQmakeEmptyPGresult(dbcon_, PGRES_FATAL_ERROR));
+		query->handler(res);
+	}
+}
+
+//reads results until a query would have to wait, or if block is true, until all queries finish
+void RC2::PGDBConnection::processAsyncResults(bool block)
+{
+	while (!asyncQueries_.empty()) {
+		sendNextQuery();
+		if (asyncQueries_.empty())
+			break;
+		auto query = asyncQueries_.front();
+		if (!block) {
+			int flushed = PQflush(dbcon_);
+			if (flushed == 1) {
+				watchSocket(true);
+				return;
+			}
+			//errors are reported by PQgetResult
+			if (flushed == 0 && PQconsumeInput(dbcon_) == 1 && PQisBusy(dbcon_)) {
+				watchSocket(false);
+				return;
+			}
+		}
+		//only the final result is passed to the handler
+		PGresult *pgres = PQgetResult(dbcon_);
+		if (pgres != NULL) {
+			PQclear(query->lastResult);
+			query->lastResult = pgres;
+			continue;
+		}
+		asyncQueries_.pop_front();
+		if (asyncQueries_.empty())
+			PQsetnonblocking(dbcon_, 0);
+		DBResult res(query->lastResult ? query->lastResult 
+			: PQmakeEmptyPGresult(dbcon_, PGRES_FATAL_ERROR));
+		query->lastResult = nullptr;
+		query->handler(res);
+	}
+}
+
+void RC2::PGDBConnection::watchSocket(bool needWrite)
+{
+	if (socketEvent_)
+		event_free(socketEvent_);
+	socketEvent_ = event_new(eventBase_, getSocket(), needWrite ? EV_READ|EV_WRITE : EV_READ, 
+		PGDBConnection::handleSocketEvent, this);
+	event_priority_set(socketEvent_, 2);
+	event_add(socketEvent_, NULL);
+}
+
+void RC2::PGDBConnection::handleSocketEvent(evutil_socket_t fd, short what, void *ctx)
+{
+	reinterpret_cast<PGDBConnection*>(ctx)->processAsyncResults(false);
+}
@@ -2,14 +2,37 @@
 
 #include <string>
 #include <memory>
+#include <functional>
 #include <stdexcept>
+#include <vector>
+#include <deque>
+#include <set>
+#include <event2/event.h>
 #include "PostgresUtils.hpp"
 
 namespace RC2 {
 
+///a statement that is prepared the first time it is used on each connection
+struct PreparedQuery {
+	const char *name;
+	const char *query;
+	int numParams;
+};
+
+///one statement of a pipeline. The arrays must stay valid until executePipeline() returns
+struct PipelineStep {
+	const PreparedQuery *stmt;
+	const char *const *paramValues;
+	const int *paramLengths;
+	const int *paramFormats;
+};
+
 class PGDBConnection {
 
 public:
+	///gets the final result of an asynchronous query. Must not throw
+	typedef std::function<void (DBResult&)> AsyncResultHandler;
+	
 	PGDBConnection();
 	virtual ~PGDBConnection();
 	
@@ -25,7 +48,37 @@ public:
 						  const char *const* paramValues, const int *paramLengths, 
 					   const int *paramFormats, int resultFormat = 1);
 	
-	DBTransaction startTransaction() { return DBTransaction(dbcon_); }
+	///the parameter arrays have stmt.numParams entries. paramLengths and paramFormats can
+	/// be NULL if all parameters are text
+	DBResult executePrepared(const PreparedQuery &stmt, const char *const* paramValues, 
+							 const int *paramLengths, const int *paramFormats, int resultFormat = 1);
+	///throws DBException if query fails. parameters are text
+	long longFromPrepared(const PreparedQuery &stmt, const char *const* paramValues = NULL);
+	
+	///sends all the statements before waiting for any results, so they cost one round trip.
+	/// They succeed or fail together unless a transaction is already open. Results are text
+	/// and in step order. Statements after a failed one have PGRES_PIPELINE_ABORTED
+	std::vector<DBResult> executePipeline(const std::vector<PipelineStep> &steps);
+	
+	///calls rowHandler with a single row result for each row as it arrives, so only one row
+	/// is in memory at a time. returns false and sets errorMessage if the query fails
+	bool streamQuery(std::string query, std::function<void (DBResult&)> rowHandler, 
+					 std::string &errorMessage, int resultFormat = 1);
+	
+	///queries from sendQuery() are read on this event loop. Without one they run immediately
+	void setEventBase(struct event_base *eventBase) { eventBase_ = eventBase; }
+	///sends the query without waiting for it. Queries run one at a time in the order sent.
+	/// paramFormats can be empty if all params are text
+	void sendQuery(std::string query, std::vector<std::string> params, 
+				   std::vector<int> paramFormats, AsyncResultHandler handler, int resultFormat = 1);
+	void sendPrepared(const PreparedQuery &stmt, std::vector<std::string> params, 
+					  std::vector<int> paramFormats, AsyncResultHandler handler, int resultFormat = 1);
+	bool asyncPending() const { return !asyncQueries_.empty(); }
+	///blocks until all sent queries have finished and their handlers have been called.
+	/// The blocking calls do this first since libpq only allows one query at a time
+	void finishAsync();
+	
+	DBTransaction startTransaction() { finishAsync(); return DBTransaction(dbcon_); }
 	
 	void escapeLiteral(std::string inString, std::string &outString) {
 		auto ptr = PQescapeLiteral(dbcon_, inString.c_str(), inString.length());
@@ -43,8 +96,20 @@ private:
 	PGDBConnection(const PGDBConnection&);
 	PGDBConnection& operator=(const PGDBConnection&);
 	
+	struct AsyncQuery;
+	void prepare(const PreparedQuery &stmt);
+	void queueQuery(std::shared_ptr<AsyncQuery> query);
+	void sendNextQuery();
+	void processAsyncResults(bool block);
+	void watchSocket(bool needWrite);
+	static void handleSocketEvent(evutil_socket_t fd, short what, void *ctx);
+	
 protected:
 	PGconn *dbcon_;
+	struct event_base *eventBase_;
+	struct event *socketEvent_;
+	std::deque<std::shared_ptr<AsyncQuery>> asyncQueries_; //front is the one sent
+	std::set<std::string> preparedNames_;
 };
 	
 };
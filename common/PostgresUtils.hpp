@@ -4,6 +4,7 @@
 #include <string>
 #include <stdexcept>
 #include <stdlib.h>
+#include <string.h>
 
 struct DBException: public std::runtime_error {
 	DBException(std::string const &message)
@@ -43,6 +44,11 @@ class DBResult {
 		const char *errorMessage() {
 			return PQresultErrorMessage(res);
 		}
+		//true if the statement gave up waiting for lock_timeout
+		bool lockTimedOut() const {
+			const char *state = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+			return state != nullptr && strcmp(state, "55P03") == 0;
+		}
 		int rowsAffected() const {
 			return atoi(PQcmdTuples(res));
 		}
@@ -62,6 +68,9 @@ class DBTransaction {
 		DBTransaction(PGconn *con) : con_(con), open_(true) {
 			DBResult res(con_, "begin");
 		}
+		DBTransaction(DBTransaction &&other) : con_(other.con_), open_(other.open_) {
+			other.open_ = false;
+		}
 		~DBTransaction() {
 			if (open_)
 				DBResult(con_, "rollback");
@@ -7,7 +7,9 @@
 typedef char* uuid_string_t;
 #endif
 #include <sys/stat.h>
+#include <sys/socket.h>
 #include <cerrno>
+#include <cstring>
 #include <fstream>
 #include <boost/filesystem.hpp>
 
@@ -64,6 +66,93 @@ RC2::ReadFileBlob(std::string filePath, size_t &size)
 	return buffer;
 }
 
+uint64_t
+RC2::HashBytes(const char *data, size_t length)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i=0; i < length; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+int
+RC2::SendFileDescriptor(int socket, int fd)
+{
+	char marker = 'F';
+	struct iovec iov = { &marker, sizeof(marker) };
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	return sendmsg(socket, &msg, 0) == 1 ? 0 : -1;
+}
+
+int
+RC2::ReceiveFileDescriptor(int socket)
+{
+	char marker;
+	struct iovec iov = { &marker, sizeof(marker) };
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t rc;
+	do {
+		rc = recvmsg(socket, &msg, 0);
+	} while (rc == -1 && errno == EINTR);
+	if (rc <= 0)
+		return -1;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+		return -1;
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+bool
+RC2::ReadProcessMemoryUsage(pid_t pid, ProcessMemoryUsage &usage)
+{
+	//smaps_rollup requires linux 4.14. smaps has the same fields per mapping, so sum them
+	std::string base = "/proc/" + std::to_string(pid);
+	std::ifstream in(base + "/smaps_rollup");
+	if (!in)
+		in.open(base + "/smaps");
+	if (!in)
+		return false;
+	usage = ProcessMemoryUsage();
+	std::string line;
+	while (std::getline(in, line)) {
+		std::string::size_type colon = line.find(':');
+		if (colon == std::string::npos)
+			continue;
+		std::string key = line.substr(0, colon);
+		long value = atol(line.c_str() + colon + 1);
+		if (key == "Rss")
+			usage.rss += value;
+		else if (key == "Pss")
+			usage.pss += value;
+		else if (key == "Shared_Clean" || key == "Shared_Dirty")
+			usage.shared += value;
+		else if (key == "Private_Clean" || key == "Private_Dirty")
+			usage.unshared += value;
+	}
+	return usage.rss > 0;
+}
 
 std::string
 RC2::GenerateUUID()
@@ -2,6 +2,7 @@
 
 #include <string>
 #include <memory>
+#include <cstdint>
 #include <algorithm>
 #include <stdlib.h>
 #include <functional>
@@ -14,10 +15,24 @@ std::string SlurpFile(const char *filename);
 std::string PrivatePackagePath();
 std::runtime_error FormatErrorAsJson(int errorCode, std::string details);
 std::unique_ptr<char[]> ReadFileBlob(std::string filePath, size_t &size);
+//64 bit FNV-1a. Fast, but not for anything adversarial
+uint64_t HashBytes(const char *data, size_t length);
+//passes a file descriptor over a unix domain socket via SCM_RIGHTS. returns -1 on error
+int SendFileDescriptor(int socket, int fd);
+//returns the received file descriptor, or -1 on error/eof
+int ReceiveFileDescriptor(int socket);
 inline void StripQuotes(std::string& str) {
 	str.erase(std::remove(str.begin(), str.end(), '\"'), str.end());
 }
 
+//sizes in kilobytes, as reported by /proc/<pid>/smaps_rollup
+struct ProcessMemoryUsage {
+	long rss, pss, shared, unshared;
+	ProcessMemoryUsage() : rss(0), pss(0), shared(0), unshared(0) {}
+};
+//returns false if the process does not exist or stats are unavailable
+bool ReadProcessMemoryUsage(pid_t pid, ProcessMemoryUsage &usage);
+
 //returns the return code from last call to mkdir
 int MakeDirectoryPath(std::string s, mode_t mode);
 
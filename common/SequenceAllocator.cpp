@@ -0,0 +1,29 @@
+#include "SequenceAllocator.hpp"
+
+const int RC2::SequenceAllocator::kDefaultBlockSize = 20;
+
+RC2::SequenceAllocator::SequenceAllocator ( std::string sequenceName, int blockSize )
+	: _stmtName("rc2_reserve_" + sequenceName), 
+	  _query("select nextval('" + sequenceName + "'::regclass) from generate_series(1, $1::int4)"),
+	  _blockSizeStr(std::to_string(blockSize))
+{
+	_stmt = {_stmtName.c_str(), _query.c_str(), 1};
+}
+
+long RC2::SequenceAllocator::next ( PGDBConnection &con )
+{
+	if (_ids.empty()) {
+		const char *params[] = {_blockSizeStr.c_str()};
+		DBResult res(con.executePrepared(_stmt, params, NULL, NULL, 0));
+		if (!res.dataReturned())
+			throw DBException(res.errorMessage());
+		int count = res.rowsReturned();
+		for (int i=0; i < count; i++)
+			_ids.push_back(atol(res.getValue(i, 0)));
+		if (_ids.empty())
+			throw DBException("no sequence values returned");
+	}
+	long value = _ids.front();
+	_ids.pop_front();
+	return value;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include "PGDBConnection.hpp"
+
+namespace RC2 {
+
+///hands out values of a database sequence, reserving them from the database in blocks so
+/// most ids don't cost a query. Unused values are lost when the allocator is destroyed
+class SequenceAllocator {
+public:
+	SequenceAllocator(std::string sequenceName, int blockSize = kDefaultBlockSize);
+	
+	static const int kDefaultBlockSize;
+	
+	///reserves another block using con when the current one is used up. throws DBException
+	long next(PGDBConnection &con);
+	
+private:
+	std::string		_stmtName, _query;
+	PreparedQuery	_stmt;
+	std::string		_blockSizeStr;
+	std::deque<long> _ids;
+	
+	//disable copying since _stmt points into the strings
+	SequenceAllocator(const SequenceAllocator&);
+	SequenceAllocator& operator=(const SequenceAllocator&);
+};
+
+};
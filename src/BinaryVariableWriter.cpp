@@ -0,0 +1,119 @@
+#include <string>
+#include <cstring>
+#include <arpa/inet.h>
+#include "BinaryVariableWriter.hpp"
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error binary variable frames send R's native vectors and require a little-endian host
+#endif
+
+using namespace std;
+
+const uint32_t kRSessionBinaryMagicNumber = 0x22;
+
+enum BinaryColumnFlags : uint8_t { kHasNABitmap = 1 };
+
+//ctx is a list holding the column. Clearing the slot drops the reference it added
+static void
+releaseSexp(const void *data, size_t len, void *ctx)
+{
+	SEXP holder = reinterpret_cast<SEXP>(ctx);
+	SET_VECTOR_ELT(holder, 0, R_NilValue);
+	R_ReleaseObject(holder);
+}
+
+static void
+releaseString(const void *data, size_t len, void *ctx)
+{
+	delete reinterpret_cast<string*>(ctx);
+}
+
+static inline bool
+isNA(SEXP sexp, R_xlen_t i)
+{
+	switch (TYPEOF(sexp)) {
+		case REALSXP: return ISNA(REAL(sexp)[i]);
+		case INTSXP: return INTEGER(sexp)[i] == NA_INTEGER;
+		case LGLSXP: return LOGICAL(sexp)[i] == NA_LOGICAL;
+		case STRSXP: return STRING_ELT(sexp, i) == NA_STRING;
+	}
+	return false;
+}
+
+bool
+RC2::IsBinaryColumnType(SEXP sexp)
+{
+	switch (TYPEOF(sexp)) {
+		case REALSXP:
+		case INTSXP:
+		case LGLSXP:
+		case STRSXP:
+			return true;
+	}
+	return false;
+}
+
+void
+RC2::AppendBinaryColumnFrame(struct evbuffer *buffer, std::vector<Rcpp::RObject> &columns)
+{
+	struct evbuffer *frame = evbuffer_new();
+	uint32_t columnCount = columns.size();
+	evbuffer_add(frame, &columnCount, sizeof(columnCount));
+	for (auto itr = columns.begin(); itr != columns.end(); ++itr) {
+		SEXP sexp = *itr;
+		uint32_t length = LENGTH(sexp);
+		uint8_t header[8] = {0};
+		size_t elementSize = 4;
+		switch (TYPEOF(sexp)) {
+			case REALSXP: header[0] = 'd'; elementSize = 8; break;
+			case INTSXP: header[0] = 'i'; break;
+			case LGLSXP: header[0] = 'b'; break;
+			case STRSXP: header[0] = 's'; break;
+			default:
+				//caller should have checked IsBinaryColumnType. send as empty
+				header[0] = 'i';
+				length = 0;
+				break;
+		}
+		string bitmap((length + 7) / 8, '\0');
+		for (uint32_t i=0; i < length; i++) {
+			if (isNA(sexp, i)) {
+				bitmap[i / 8] |= 1 << (i % 8);
+				header[1] = kHasNABitmap;
+			}
+		}
+		memcpy(&header[4], &length, sizeof(length));
+		evbuffer_add(frame, header, sizeof(header));
+		if (header[1] & kHasNABitmap)
+			evbuffer_add(frame, bitmap.data(), bitmap.length());
+		if (length == 0)
+			continue;
+		if (TYPEOF(sexp) == STRSXP) {
+			vector<uint32_t> offsets(length + 1);
+			string *bytes = new string();
+			for (uint32_t i=0; i < length; i++) {
+				offsets[i] = bytes->length();
+				SEXP elem = STRING_ELT(sexp, i);
+				if (elem != NA_STRING)
+					bytes->append(CHAR(elem), LENGTH(elem));
+			}
+			offsets[length] = bytes->length();
+			evbuffer_add(frame, offsets.data(), offsets.size() * sizeof(uint32_t));
+			evbuffer_add_reference(frame, bytes->data(), bytes->length(), releaseString, bytes);
+		} else {
+			//the list's reference makes R copy instead of modifying in place while libevent
+			// still references the data
+			SEXP holder = Rf_allocVector(VECSXP, 1);
+			R_PreserveObject(holder);
+			SET_VECTOR_ELT(holder, 0, sexp);
+			void *data = TYPEOF(sexp) == REALSXP ? (void*)REAL(sexp) : (void*)INTEGER(sexp);
+			evbuffer_add_reference(frame, data, length * elementSize, releaseSexp, holder);
+		}
+	}
+	uint32_t frameHeader[2];
+	frameHeader[0] = htonl(kRSessionBinaryMagicNumber);
+	frameHeader[1] = htonl(evbuffer_get_length(frame));
+	evbuffer_add(buffer, frameHeader, sizeof(frameHeader));
+	evbuffer_add_buffer(buffer, frame);
+	evbuffer_free(frame);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <vector>
+#include <event2/buffer.h>
+#define STRICT_R_HEADERS
+#include <Rcpp.h>
+
+extern const uint32_t kRSessionBinaryMagicNumber;
+
+namespace RC2 {
+
+	//true for vector types that can be sent as a binary column
+	bool IsBinaryColumnType(SEXP sexp);
+	
+	//Appends a binary variable frame holding columns to buffer. The frame header matches
+	// json frames (magic number, payload length) and the payload is
+	//   uint32 column count, then per column:
+	//   uint8 type ('d' double, 'i' integer, 'b' logical as int32, 's' string), uint8 flags
+	//   (1 = NA bitmap present), uint16 reserved, uint32 element count, the NA bitmap
+	//   ((count + 7) / 8 bytes, lsb first) if flagged, then the data. Strings are uint32
+	//   offsets[count + 1] followed by the utf-8 bytes. All values are little-endian.
+	// Numeric data is referenced in place; those SEXPs hold an extra reference, so R copies
+	// them on modification, until libevent releases them. Factors are sent as their integer
+	// codes; the json lists their levels.
+	void AppendBinaryColumnFrame(struct evbuffer *buffer, std::vector<Rcpp::RObject> &columns);
+
+};
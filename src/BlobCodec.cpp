@@ -0,0 +1,69 @@
+#include "BlobCodec.hpp"
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <endian.h>
+#include <zlib.h>
+#include "../common/FormattedException.hpp"
+
+using namespace std;
+
+//magic, codec byte, then the uncompressed length as a big endian uint64
+static const char kBlobMagic[] = {'R', 'C', '2', 'Z'};
+const size_t kBlobHeaderSize = sizeof(kBlobMagic) + 1 + sizeof(uint64_t);
+
+RC2::BlobCodec
+RC2::BlobCodecNamed(const string &name)
+{
+	if (name == "none")
+		return BlobCodec::None;
+	if (name == "zlib")
+		return BlobCodec::Zlib;
+	throw runtime_error("unknown codec " + name);
+}
+
+string
+RC2::EncodeBlob(BlobCodec codec, const char *data, size_t length)
+{
+	string blob(kBlobHeaderSize, '\0');
+	memcpy(&blob[0], kBlobMagic, sizeof(kBlobMagic));
+	blob[sizeof(kBlobMagic)] = (char)codec;
+	uint64_t beLength = htobe64(length);
+	memcpy(&blob[sizeof(kBlobMagic) + 1], &beLength, sizeof(beLength));
+	if (codec == BlobCodec::None) {
+		blob.append(data, length);
+		return blob;
+	}
+	uLongf compressedSize = compressBound(length);
+	blob.resize(kBlobHeaderSize + compressedSize);
+	//level 1 since save latency matters more than the last few percent of size
+	int rc = compress2((Bytef*)&blob[kBlobHeaderSize], &compressedSize, (const Bytef*)data, length, 1);
+	if (rc != Z_OK)
+		throw FormattedException("compress failed: %d", rc);
+	blob.resize(kBlobHeaderSize + compressedSize);
+	return blob;
+}
+
+string
+RC2::DecodeBlob(const char *data, size_t length)
+{
+	if (length < kBlobHeaderSize || memcmp(data, kBlobMagic, sizeof(kBlobMagic)) != 0)
+		return string(data, length);
+	BlobCodec codec = (BlobCodec)data[sizeof(kBlobMagic)];
+	uint64_t beLength;
+	memcpy(&beLength, data + sizeof(kBlobMagic) + 1, sizeof(beLength));
+	uLongf decodedSize = be64toh(beLength);
+	if (codec == BlobCodec::None) {
+		if (decodedSize != length - kBlobHeaderSize)
+			throw FormattedException("blob length %lu doesn't match header", (unsigned long)(length - kBlobHeaderSize));
+		return string(data + kBlobHeaderSize, decodedSize);
+	}
+	if (codec != BlobCodec::Zlib)
+		throw FormattedException("unknown blob codec %d", (int)codec);
+	string decoded(decodedSize, '\0');
+	int rc = uncompress((Bytef*)&decoded[0], &decodedSize, (const Bytef*)data + kBlobHeaderSize, 
+		length - kBlobHeaderSize);
+	if (rc != Z_OK || decodedSize != decoded.length())
+		throw FormattedException("uncompress failed: %d", rc);
+	return decoded;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+
+namespace RC2 {
+
+	//how workspace data is compressed before it is stored in the database
+	enum class BlobCodec { None = 0, Zlib = 1 };
+
+	//"none" or "zlib". throws std::runtime_error for anything else
+	BlobCodec BlobCodecNamed(const std::string &name);
+	//prefixes a header naming the codec, even for None, so stored data can't be mistaken
+	// for a header
+	std::string EncodeBlob(BlobCodec codec, const char *data, size_t length);
+	//data without a header is returned as is, so blobs stored before there were codecs
+	// still load. throws FormattedException if the data is corrupt
+	std::string DecodeBlob(const char *data, size_t length);
+
+};
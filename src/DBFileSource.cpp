@@ -1,10 +1,24 @@
 #include <fstream>
 #include <sstream>
+#include <array>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <arpa/inet.h>
+#include <endian.h>
 #include <utime.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
 #include "DBFileSource.hpp"
+#include "FileCache.hpp"
 #include "../common/PostgresUtils.hpp"
 #include "../common/FormattedException.hpp"
+#include "../common/SequenceAllocator.hpp"
 #define BOOST_NO_CXX11_SCOPED_ENUMS
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
@@ -15,10 +29,129 @@ using namespace std;
 using boost::format;
 namespace fs = boost::filesystem;
 
+const size_t RC2::kFileChunkSize = 64 * 1024;
+
+vector<uint64_t>
+RC2::FileChunkHashes(const char *data, size_t length)
+{
+	vector<uint64_t> hashes;
+	for (size_t offset=0; offset < length; offset += kFileChunkSize)
+		hashes.push_back(HashBytes(data + offset, min(kFileChunkSize, length - offset)));
+	return hashes;
+}
+
 class RC2::DBFileSource::Impl {
 public:
 	long wspaceId_;
 	string workingDir_;
+	shared_ptr<FileCache> cache_;
+	SequenceAllocator fileIds_{"rcfile_seq", 10};
+	unique_ptr<DBTransaction> batch_; //set between beginBatch() and commitBatch()
+	vector<function<void()>> batchUpdates_; //returned by commitBatch() to apply to memory
+	
+	//returns nullptr if the work is part of a batch and should not be committed separately
+	unique_ptr<DBTransaction> startTransaction(shared_ptr<PGDBConnection> dbcon) {
+		if (batch_)
+			return nullptr;
+		return unique_ptr<DBTransaction>(new DBTransaction(dbcon->startTransaction()));
+	}
+	
+	//in a batch, memory isn't changed until the database is, and then by the caller
+	void applyWhenCommitted(function<void()> update) {
+		if (batch_)
+			batchUpdates_.push_back(update);
+		else
+			update();
+	}
+	
+	DBFileInfoPtr fileInfoForRow(uint32_t fileId, uint32_t version, string &name, 
+		map<long, DBFileInfoPtr> &filesById) 
+	{
+		DBFileInfoPtr filePtr;
+		if (filesById.count(fileId) > 0) {
+			filePtr = filesById.at(fileId);
+			filePtr->version = version;
+			filePtr->name = name;
+		} else {
+			filePtr = DBFileInfoPtr(new DBFileInfo(fileId, version, name));
+			filesById.insert(map<long,DBFileInfoPtr>::value_type(fileId, filePtr));
+		}
+		return filePtr;
+	}
+	
+	bool rdataChunksChecked_ = false, rdataChunksExist_ = false;
+	
+	bool checkpointChecked_ = false, checkpointExists_ = false;
+	BlobCodec codec_ = BlobCodec::None;
+	
+	bool haveRDataChunks(PGDBConnection &con);
+	
+	//returns 0 or an errno. Space is reserved first so a full disk fails before anything is written
+	int writeFile(const fs::path &filepath, const char *data, size_t length) {
+		int fd = open(filepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == -1)
+			return errno;
+		Defer closeFd([fd]() { close(fd); });
+		if (length > 0 && posix_fallocate(fd, 0, length) == ENOSPC)
+			return ENOSPC;
+		return writeAll(fd, data, length);
+	}
+	
+	//returns 0 or an errno
+	int writeAll(int fd, const char *data, size_t length) {
+		while (length > 0) {
+			ssize_t written = write(fd, data, length);
+			if (written < 0) {
+				if (errno == EINTR)
+					continue;
+				return errno;
+			}
+			data += written;
+			length -= written;
+		}
+		return 0;
+	}
+	
+	vector<uint64_t> fileChunkHashes(const fs::path &filepath) {
+		vector<uint64_t> hashes;
+		ifstream file(filepath.string(), ios::in | ios::binary);
+		unique_ptr<char[]> buffer(new char[kFileChunkSize]);
+		while (file.read(buffer.get(), kFileChunkSize) || file.gcount() > 0)
+			hashes.push_back(HashBytes(buffer.get(), file.gcount()));
+		return hashes;
+	}
+	
+	//[start, end) runs of chunks that differ between the database and newHashes. returns
+	// false if the database contents are unknown or most of the file changed
+	bool changedChunkRuns(DBFileInfoPtr fobj, const vector<uint64_t> &newHashes, size_t newSize,
+		vector<pair<size_t, size_t>> &runs)
+	{
+		const vector<uint64_t> &oldHashes = fobj->chunkHashes;
+		if (oldHashes.empty() || newHashes.empty())
+			return false;
+		auto same = [&](size_t i) { 
+			return i < oldHashes.size() && i < newHashes.size() && oldHashes[i] == newHashes[i]; 
+		};
+		size_t count = max(oldHashes.size(), newHashes.size()), changedChunks = 0;
+		for (size_t i=0; i < count; ) {
+			if (same(i)) {
+				i++;
+				continue;
+			}
+			size_t start = i;
+			while (i < count && !same(i))
+				i++;
+			runs.push_back(make_pair(start, i));
+			changedChunks += i - start;
+		}
+		return changedChunks * kFileChunkSize < newSize / 2;
+	}
+	
+	void setModificationTime(const fs::path &filepath, time_t lastmod) {
+		struct utimbuf modbuf;
+		modbuf.actime = modbuf.modtime = lastmod;
+		utime(filepath.c_str(), &modbuf);
+	}
 };
 
 
@@ -35,6 +168,7 @@ void
 RC2::DBFileSource::initializeSource(std::shared_ptr<PGDBConnection> connection, long wsid)
 {
 	dbcon_ = connection;
+	writeCon_ = connection;
 	_impl->wspaceId_ = wsid;
 	//verify workspace exists in database
 	ostringstream query;
@@ -50,127 +184,566 @@ RC2::DBFileSource::setWorkingDir(string workingDir)
 	_impl->workingDir_ = workingDir;
 }
 
+void
+RC2::DBFileSource::setFileCache(shared_ptr<FileCache> cache)
+{
+	_impl->cache_ = cache;
+}
+
+//.RData is read and written in pieces this size so a large workspace is never all in memory
+const size_t kRDataChunkSize = 1024 * 1024;
+
+static const RC2::PreparedQuery kRDataChunksExistStmt = {"rc2_rdata_chunks_exist", 
+	"select to_regclass('rcworkspacedatachunk') is not null", 0};
+static const RC2::PreparedQuery kLockWorkspaceStmt = {"rc2_lock_workspace", 
+	"select id from rcworkspace where id = $1::int4 for update", 1};
+static const RC2::PreparedQuery kDeleteRDataChunksStmt = {"rc2_delete_rdata_chunks", 
+	"delete from rcworkspacedatachunk where wspaceid = $1::int4", 1};
+static const RC2::PreparedQuery kInsertRDataChunkStmt = {"rc2_insert_rdata_chunk", 
+	"insert into rcworkspacedatachunk (wspaceid, chunknum, data) values ($1::int4, $2::int4, $3::bytea)", 3};
+static const RC2::PreparedQuery kDeleteLegacyRDataStmt = {"rc2_delete_legacy_rdata", 
+	"delete from rcworkspacedata where id = $1::int4", 1};
+static const RC2::PreparedQuery kLegacyRDataLengthStmt = {"rc2_legacy_rdata_length", 
+	"select octet_length(bindata) from rcworkspacedata where id = $1::int4", 1};
+static const RC2::PreparedQuery kLegacyRDataChunkStmt = {"rc2_legacy_rdata_chunk", 
+	"select substring(bindata from $2::int8 for $3::int4) from rcworkspacedata where id = $1::int4", 3};
+
+bool
+RC2::DBFileSource::Impl::haveRDataChunks(PGDBConnection &con)
+{
+	if (rdataChunksChecked_)
+		return rdataChunksExist_;
+	DBResult res = con.executePrepared(kRDataChunksExistStmt, NULL, NULL, NULL, 0);
+	rdataChunksExist_ = res.dataReturned() && string(res.getValue(0, 0)) == "t";
+	rdataChunksChecked_ = true;
+	if (!rdataChunksExist_)
+		LOG(INFO) << "rcworkspacedatachunk missing, using rcworkspacedata" << std::endl;
+	return rdataChunksExist_;
+}
+
+//reads the chunks as they arrive, or the legacy bytea a piece at a time
 bool
 RC2::DBFileSource::loadRData()
 {
 	string filepath = _impl->workingDir_ + "/.RData";
-	ostringstream query;
-	query << "select bindata from rcworkspacedata where id = " << _impl->wspaceId_;
-	LOG(INFO) << "load:" << query.str() << std::endl;
-	DBResult res = dbcon_->executeQuery(query.str(), 0, NULL, NULL, NULL, NULL, 1);
-//	ExecStatusType rc = PQresultStatus(res);
-	if (res.dataReturned()) {
-		int datalen = res.getLength(0, 0);
-		if (datalen > 0) {
-			char *data = res.getValue(0, 0);
-			ofstream rdata;
-			rdata.open(filepath, ios::out | ios::trunc | ios::binary);
-			rdata.write(data, datalen);
-			rdata.close();
-			LOG(INFO) << ".RData loaded" << std::endl;
-			return true;
+	string wspaceStr = to_string(_impl->wspaceId_);
+	int fd = open(filepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		LOG(WARNING) << "failed to create .RData: " << strerror(errno) << std::endl;
+		return false;
+	}
+	Defer closeFd([fd]() { close(fd); });
+	size_t loaded = 0;
+	if (_impl->haveRDataChunks(*dbcon_)) {
+		string query = "select data from rcworkspacedatachunk where wspaceid = " + wspaceStr + 
+			" order by chunknum";
+		string errorMessage;
+		bool success = dbcon_->streamQuery(query, [this, fd, &loaded](DBResult &res) {
+			string chunk = DecodeBlob(res.getValue(0, 0), res.getLength(0, 0));
+			int err = _impl->writeAll(fd, chunk.data(), chunk.length());
+			if (err != 0)
+				throw FormattedException("failed to write .RData: %s", strerror(err));
+			loaded += chunk.length();
+		}, errorMessage);
+		if (!success) {
+			LOG(WARNING) << "failed to load .RData: " << errorMessage << std::endl;
+			loaded = 0;
+		}
+	}
+	if (loaded == 0) {
+		const char *lengthParams[] = {wspaceStr.c_str()};
+		DBResult lengthRes = dbcon_->executePrepared(kLegacyRDataLengthStmt, lengthParams, NULL, NULL, 0);
+		size_t length = 0;
+		if (lengthRes.dataReturned() && lengthRes.rowsReturned() > 0)
+			length = atol(lengthRes.getValue(0, 0));
+		string chunkSizeStr = to_string(kRDataChunkSize);
+		for (size_t offset=0; offset < length; offset += kRDataChunkSize) {
+			string fromStr = to_string(offset + 1);
+			const char *params[] = {wspaceStr.c_str(), fromStr.c_str(), chunkSizeStr.c_str()};
+			DBResult res = dbcon_->executePrepared(kLegacyRDataChunkStmt, params, NULL, NULL, 1);
+			if (!res.dataReturned() || res.rowsReturned() < 1) {
+				LOG(WARNING) << "failed to load .RData: " << res.errorMessage() << std::endl;
+				loaded = 0;
+				break;
+			}
+			int err = _impl->writeAll(fd, res.getValue(0, 0), res.getLength(0, 0));
+			if (err != 0) {
+				LOG(WARNING) << "failed to write .RData: " << strerror(err) << std::endl;
+				loaded = 0;
+				break;
+			}
+			loaded += res.getLength(0, 0);
 		}
 	}
+	if (loaded > 0) {
+		LOG(INFO) << ".RData loaded" << std::endl;
+		return true;
+	}
+	fs::remove(filepath);
 	LOG(INFO) << ".RData not loaded" << std::endl;
 	return false;
 }
 
+//a save that can't get its row lock in this long is rolled back and retried. The last
+// attempt waits as long as it takes, so the workspace is never lost
+static const char *kSaveRDataLockTimeout = "set local lock_timeout = '5s'";
+static const char *kSaveRDataNoLockTimeout = "set local lock_timeout = 0";
+const int kSaveRDataAttempts = 4;
+
+//.RData chunks are read and compressed on one thread while earlier ones are sent. It stays
+// at most this many chunks ahead, so memory doesn't grow when the database is slower
+const size_t kRDataChunksAhead = 4;
+
+class RDataChunkReader {
+public:
+	RDataChunkReader(ifstream &rdata, RC2::BlobCodec codec)
+		: rdata_(rdata), codec_(codec), done_(false), stop_(false)
+	{
+		thread_ = thread(&RDataChunkReader::run, this);
+	}
+	
+	~RDataChunkReader() {
+		{
+			lock_guard<mutex> lock(mutex_);
+			stop_ = true;
+		}
+		changed_.notify_all();
+		thread_.join();
+	}
+	
+	//blocks until the next chunk is ready. Empty at the end of the file. Throws if
+	// reading or compressing failed
+	string next() {
+		unique_lock<mutex> lock(mutex_);
+		changed_.wait(lock, [this]() { return !chunks_.empty() || done_; });
+		if (chunks_.empty()) {
+			if (error_)
+				rethrow_exception(error_);
+			return string();
+		}
+		string chunk = std::move(chunks_.front());
+		chunks_.pop_front();
+		changed_.notify_all();
+		return chunk;
+	}
+
+private:
+	void run() {
+		exception_ptr error;
+		try {
+			for (;;) {
+				string raw(kRDataChunkSize, '\0');
+				rdata_.read(&raw[0], kRDataChunkSize);
+				raw.resize(rdata_.gcount());
+				if (raw.empty())
+					break;
+				string chunk = RC2::EncodeBlob(codec_, raw.data(), raw.length());
+				unique_lock<mutex> lock(mutex_);
+				changed_.wait(lock, [this]() { return chunks_.size() < kRDataChunksAhead || stop_; });
+				if (stop_)
+					break;
+				chunks_.push_back(std::move(chunk));
+				changed_.notify_all();
+			}
+		} catch (...) {
+			error = current_exception();
+		}
+		lock_guard<mutex> lock(mutex_);
+		error_ = error;
+		done_ = true;
+		changed_.notify_all();
+	}
+
+	ifstream &rdata_;
+	RC2::BlobCodec codec_;
+	mutex mutex_;
+	condition_variable changed_;
+	deque<string> chunks_;
+	exception_ptr error_;
+	bool done_, stop_;
+	thread thread_; //last, so everything it uses exists first
+};
+
+static const RC2::PreparedQuery kUpsertLegacyRDataStmt = {"rc2_upsert_legacy_rdata", 
+	"insert into rcworkspacedata (id, bindata) values ($1::int4, $2::bytea) "
+	"on conflict (id) do update set bindata = excluded.bindata", 2};
+
+//only the workspace's own rows are locked, so sessions closing at the same time save in parallel
 void
 RC2::DBFileSource::saveRData()
 {
-	size_t newSize=0;
 	string filePath = _impl->workingDir_ + "/.RData";
 	if (!fs::exists(filePath)) {
 		LOG(INFO) << "no .RData file to save" << std::endl;
 		return;
 	}
-	unique_ptr<char[]> data = ReadFileBlob(filePath, newSize);
+	bool chunked = _impl->haveRDataChunks(*dbcon_);
+	for (int attempt=1; attempt <= kSaveRDataAttempts; attempt++) {
+		bool wait = attempt == kSaveRDataAttempts;
+		if (chunked ? saveRDataChunks(filePath, wait) : saveLegacyRData(filePath, wait))
+			return;
+		LOG(INFO) << "saveRData timed out waiting for lock, attempt " << attempt << std::endl;
+		this_thread::sleep_for(chrono::milliseconds(100 * attempt));
+	}
+	throw FormattedException("failed to save rdata %ld: lock timeout", _impl->wspaceId_);
+}
+
+//returns false if a row lock timed out
+bool
+RC2::DBFileSource::saveRDataChunks(string filePath, bool waitForLock)
+{
+	ifstream rdata(filePath, ios::in | ios::binary);
+	if (!rdata)
+		throw FormattedException("failed to open .RData for saving");
+	string wspaceStr = to_string(_impl->wspaceId_);
+	const char *wspaceParams[] = {wspaceStr.c_str()};
 	DBTransaction trans = dbcon_->startTransaction();
-	DBResult lockRes = dbcon_->executeQuery("lock table rcworkspacedata in access exclusive mode");
-	if (!lockRes.commandOK()) {
-		LOG(WARNING) << "saveRData failed to get lock on table" << std::endl;
-		return;
+	dbcon_->executeQuery(waitForLock ? kSaveRDataNoLockTimeout : kSaveRDataLockTimeout);
+	DBResult lockRes = dbcon_->executePrepared(kLockWorkspaceStmt, wspaceParams, NULL, NULL, 0);
+	if (lockRes.lockTimedOut())
+		return false;
+	if (!lockRes.dataReturned())
+		throw FormattedException("failed to lock workspace %ld: %s", _impl->wspaceId_, lockRes.errorMessage());
+	DBResult delRes = dbcon_->executePrepared(kDeleteRDataChunksStmt, wspaceParams, NULL, NULL);
+	if (delRes.lockTimedOut())
+		return false;
+	if (!delRes.commandOK())
+		throw FormattedException("failed to clear rdata chunks %ld: %s", _impl->wspaceId_, delRes.errorMessage());
+	RDataChunkReader reader(rdata, _impl->codec_);
+	int chunkNum = 0;
+	for (string chunk = reader.next(); !chunk.empty(); chunk = reader.next()) {
+		string chunkStr = to_string(chunkNum++);
+		int pformats[] = {0, 0, 1};
+		int pSizes[] = {0, 0, (int)chunk.length()};
+		const char *params[] = {wspaceStr.c_str(), chunkStr.c_str(), chunk.data()};
+		DBResult res = dbcon_->executePrepared(kInsertRDataChunkStmt, params, pSizes, pformats);
+		if (!res.commandOK())
+			throw FormattedException("failed to save rdata %ld: %s", _impl->wspaceId_, res.errorMessage());
 	}
-	ostringstream query;
-	query << "update rcworkspacedata set bindata = $1::bytea where id = " << _impl->wspaceId_;
-	int pformats[] = {1};
-	int pSizes[] = {(int)newSize};
-	const char *params[] = {data.get()};
-	DBResult res = dbcon_->executeQuery(query.str(), 1, NULL, params, pSizes, pformats, 1);
+	//so an older copy can't be loaded instead
+	DBResult legacyRes = dbcon_->executePrepared(kDeleteLegacyRDataStmt, wspaceParams, NULL, NULL);
+	if (legacyRes.lockTimedOut())
+		return false;
+	if (!legacyRes.commandOK())
+		throw FormattedException("failed to remove old rdata %ld: %s", _impl->wspaceId_, legacyRes.errorMessage());
+	clearCheckpoint(*dbcon_);
+	DBResult commitRes(trans.commit());
+	if (!commitRes.commandOK()) {
+		throw FormattedException("failed to commit save rdata");
+	}
+	LOG(INFO) << "saved .RData in " << chunkNum << " chunks" << std::endl;
+	return true;
+}
+
+//for databases without rcworkspacedatachunk. Returns false if the row lock timed out
+bool
+RC2::DBFileSource::saveLegacyRData(string filePath, bool waitForLock)
+{
+	size_t newSize=0;
+	unique_ptr<char[]> data = ReadFileBlob(filePath, newSize);
+	string wspaceStr = to_string(_impl->wspaceId_);
+	DBTransaction trans = dbcon_->startTransaction();
+	dbcon_->executeQuery(waitForLock ? kSaveRDataNoLockTimeout : kSaveRDataLockTimeout);
+	int pformats[] = {0, 1};
+	int pSizes[] = {0, (int)newSize};
+	const char *params[] = {wspaceStr.c_str(), data.get()};
+	DBResult res = dbcon_->executePrepared(kUpsertLegacyRDataStmt, params, pSizes, pformats);
+	if (res.lockTimedOut())
+		return false;
 	if (!res.commandOK()) {
-		throw FormattedException("failed to update rcworkspacedata %ld: %s", _impl->wspaceId_, res.errorMessage());
-	}
-	if (res.rowsAffected() < 1) {
-		ostringstream iquery;
-		iquery << "insert into rcworkspacedata (id,bindata) values (" << _impl->wspaceId_ << ", $1::bytea)";
-		DBResult iRes = dbcon_->executeQuery(iquery.str(), 1, NULL, params, pSizes, pformats, 1);
-		if (!iRes.commandOK()) {
-			throw FormattedException("failed to insert rcworkspacedata %ld:%s", _impl->wspaceId_, iRes.errorMessage());
-		}
+		throw FormattedException("failed to save rcworkspacedata %ld: %s", _impl->wspaceId_, res.errorMessage());
 	}
+	clearCheckpoint(*dbcon_);
 	DBResult commitRes(trans.commit());
 	if (!commitRes.commandOK()) {
 		throw FormattedException("failed to commit save rdata");
 	}
+	return true;
+}
+
+//the row with an empty name marks that a checkpoint exists, even one with no variables
+static const RC2::PreparedQuery kCheckpointExistsStmt = {"rc2_checkpoint_exists", 
+	"select to_regclass('rcworkspacevar') is not null", 0};
+static const RC2::PreparedQuery kUpsertCheckpointVarStmt = {"rc2_upsert_checkpoint_var", 
+	"insert into rcworkspacevar (wspaceid, name, hash, data) values ($1::int4, $2, $3::int8, $4::bytea) "
+	"on conflict (wspaceid, name) do update set hash = excluded.hash, data = excluded.data", 4};
+static const RC2::PreparedQuery kDeleteCheckpointVarStmt = {"rc2_delete_checkpoint_var", 
+	"delete from rcworkspacevar where wspaceid = $1::int4 and name = $2", 2};
+static const RC2::PreparedQuery kClearCheckpointStmt = {"rc2_clear_checkpoint", 
+	"delete from rcworkspacevar where wspaceid = $1::int4", 1};
+
+void
+RC2::DBFileSource::setCodec(BlobCodec codec)
+{
+	_impl->codec_ = codec;
+}
+
+//the single row fallback stores .RData as is
+bool
+RC2::DBFileSource::compressesRData()
+{
+	return _impl->codec_ != BlobCodec::None && _impl->haveRDataChunks(*dbcon_);
+}
+
+bool
+RC2::DBFileSource::checkpointAvailable()
+{
+	if (!_impl->checkpointChecked_) {
+		DBResult res = dbcon_->executePrepared(kCheckpointExistsStmt, NULL, NULL, NULL, 0);
+		_impl->checkpointExists_ = res.dataReturned() && string(res.getValue(0, 0)) == "t";
+		_impl->checkpointChecked_ = true;
+	}
+	return _impl->checkpointExists_;
+}
+
+//con can be another thread's connection, so this must not touch any cached state
+void
+RC2::DBFileSource::saveCheckpoint(PGDBConnection &con, const vector<CheckpointVariable> &changed, 
+	const vector<string> &removed, bool replace)
+{
+	string wspaceStr = to_string(_impl->wspaceId_);
+	DBTransaction trans = con.startTransaction();
+	if (replace) {
+		const char *params[] = {wspaceStr.c_str()};
+		DBResult res = con.executePrepared(kClearCheckpointStmt, params, NULL, NULL);
+		if (!res.commandOK())
+			throw FormattedException("failed to clear checkpoint %ld: %s", _impl->wspaceId_, res.errorMessage());
+	}
+	for (auto &name : removed) {
+		const char *params[] = {wspaceStr.c_str(), name.c_str()};
+		DBResult res = con.executePrepared(kDeleteCheckpointVarStmt, params, NULL, NULL);
+		if (!res.commandOK())
+			throw FormattedException("failed to remove checkpoint of %s: %s", name.c_str(), res.errorMessage());
+	}
+	BlobCodec codec = _impl->codec_;
+	auto upsert = [&con, &wspaceStr, codec](const CheckpointVariable &var) {
+		string hashStr = to_string((int64_t)var.hash);
+		string data = EncodeBlob(codec, var.data.data(), var.data.length());
+		int pformats[] = {0, 0, 0, 1};
+		int pSizes[] = {0, 0, 0, (int)data.length()};
+		const char *params[] = {wspaceStr.c_str(), var.name.c_str(), hashStr.c_str(), data.data()};
+		DBResult res = con.executePrepared(kUpsertCheckpointVarStmt, params, pSizes, pformats);
+		if (!res.commandOK())
+			throw FormattedException("failed to checkpoint %s: %s", var.name.c_str(), res.errorMessage());
+	};
+	upsert(CheckpointVariable{"", 0, ""});
+	for (auto &var : changed)
+		upsert(var);
+	DBResult commitRes(trans.commit());
+	if (!commitRes.commandOK())
+		throw FormattedException("failed to commit checkpoint");
+	LOG(INFO) << "checkpointed " << changed.size() << " variables, removed " << removed.size() << std::endl;
+}
+
+bool
+RC2::DBFileSource::loadCheckpoint(function<void (const CheckpointVariable&)> handler)
+{
+	if (!checkpointAvailable())
+		return false;
+	string query = "select name, hash, data from rcworkspacevar where wspaceid = " + 
+		to_string(_impl->wspaceId_);
+	bool found = false;
+	string errorMessage;
+	bool success = dbcon_->streamQuery(query, [&found, &handler](DBResult &res) {
+		CheckpointVariable var;
+		var.name.assign(res.getValue(0, 0), res.getLength(0, 0));
+		uint64_t hash;
+		memcpy(&hash, res.getValue(0, 1), sizeof(hash));
+		var.hash = be64toh(hash);
+		found = true;
+		if (var.name.empty())
+			return;
+		try {
+			var.data = DecodeBlob(res.getValue(0, 2), res.getLength(0, 2));
+		} catch (std::exception &e) {
+			LOG(WARNING) << "skipping checkpoint of " << var.name << ": " << e.what() << std::endl;
+			return;
+		}
+		handler(var);
+	}, errorMessage);
+	if (!success) {
+		LOG(WARNING) << "failed to load checkpoint: " << errorMessage << std::endl;
+		return false;
+	}
+	return found;
+}
+
+void
+RC2::DBFileSource::clearCheckpoint(PGDBConnection &con)
+{
+	if (!checkpointAvailable())
+		return;
+	string wspaceStr = to_string(_impl->wspaceId_);
+	const char *params[] = {wspaceStr.c_str()};
+	DBResult res = con.executePrepared(kClearCheckpointStmt, params, NULL, NULL);
+	if (!res.commandOK())
+		throw FormattedException("failed to clear checkpoint %ld: %s", _impl->wspaceId_, res.errorMessage());
+}
+
+#define FILE_CONTENTS_QUERY "select f.id::int4, f.version::int4, f.name, " \
+	"extract('epoch' from f.lastmodified)::int4, d.bindata " \
+	"from rcfile f join rcfiledata d on f.id = d.id "
+
+static const RC2::PreparedQuery kFileContentsStmt = {"rc2_file_contents", 
+	FILE_CONTENTS_QUERY "where f.id = $1::int4", 1};
+static const RC2::PreparedQuery kInsertFileStmt = {"rc2_insert_file", 
+	"insert into rcfile (id, version, wspaceid, name, filesize, lastmodified) "
+	"values ($1::int4, 1, $2::int4, $3, $4::int8, to_timestamp($5::int8))", 5};
+static const RC2::PreparedQuery kInsertFileDataStmt = {"rc2_insert_file_data", 
+	"insert into rcfiledata (id, bindata) values ($1::int4, $2::bytea)", 2};
+static const RC2::PreparedQuery kUpdateFileStmt = {"rc2_update_file", 
+	"update rcfile set version = $1::int4, lastmodified = to_timestamp($2::int8), "
+	"filesize = $3::int8 where id = $4::int4", 4};
+static const RC2::PreparedQuery kUpdateFileVersionStmt = {"rc2_update_file_version", 
+	"update rcfile set version = $1::int4, lastmodified = to_timestamp($2::int8), "
+	"filesize = $3::int8 where id = $4::int4 and version = $5::int4", 5};
+static const RC2::PreparedQuery kUpdateFileDataStmt = {"rc2_update_file_data", 
+	"update rcfiledata set bindata = $1::bytea where id = $2::int4", 2};
+static const RC2::PreparedQuery kOverlayFileDataStmt = {"rc2_overlay_file_data", 
+	"update rcfiledata set bindata = overlay(bindata placing $1::bytea from $2::int4 for $3::int4) "
+	"where id = $4::int4", 4};
+static const RC2::PreparedQuery kDeleteFileStmt = {"rc2_delete_file", 
+	"delete from rcfile where id = $1::int4", 1};
+
+void
+RC2::DBFileSource::writeFileRow(DBResult &res, int row)
+{
+	uint32_t pid=0, pver=0, lastmod=0;
+	string pname;
+	char *ptr;
+	ptr = res.getValue(row, 0);
+	pid = ntohl(*(uint32_t*)ptr);
+	ptr = res.getValue(row, 1);
+	pver = ntohl(*(uint32_t*)ptr);
+	pname = res.getValue(row, 2);
+	ptr = res.getValue(row, 3);
+	lastmod = ntohl(*(uint32_t*)ptr);
+	int datalen = res.getLength(row, 4);
+	char *data = res.getValue(row, 4);
+	DBFileInfoPtr filePtr = _impl->fileInfoForRow(pid, pver, pname, filesById_);
+	filePtr->chunkHashes = FileChunkHashes(data, datalen);
+	//write data to disk
+	fs::path filepath(_impl->workingDir_);
+	filepath /= pname;
+	int err = _impl->writeFile(filepath, data, datalen);
+	if (err != 0)
+		throw FormattedException("failed to write %s: %s", pname.c_str(), strerror(err));
+	_impl->setModificationTime(filepath, lastmod);
+	filePtr->lastModified = lastmod;
+	filePtr->size = datalen;
+	filePtr->materialized = true;
+	filePtr->cacheKey = FileCacheKey(pid, pver);
+	if (_impl->cache_)
+		_impl->cache_->add(filePtr->cacheKey, filepath.string());
 }
 
 void
 RC2::DBFileSource::loadFiles(const char *whereClause)
+{
+	ostringstream query;
+	query << FILE_CONTENTS_QUERY << whereClause;
+	//each row is written to disk and freed as it arrives instead of buffering every file
+	string errorMessage;
+	bool success = dbcon_->streamQuery(query.str(), [this](DBResult &res) {
+		writeFileRow(res, 0);
+	}, errorMessage);
+	if (!success)
+		LOG(WARNING) << "sql error: " << errorMessage << endl;
+}
+
+void
+RC2::DBFileSource::loadFileMetadata(const char *whereClause)
 {
 	ostringstream query;
 	query << "select f.id::int4, f.version::int4, f.name, extract('epoch' from f.lastmodified)::int4, " 
-		"d.bindata from rcfile f join rcfiledata d on f.id = d.id " << whereClause;
+		"coalesce(f.filesize, 0)::int8 from rcfile f " << whereClause;
 	DBResult res = dbcon_->executeQuery(query.str(), 0, NULL, NULL, NULL, NULL);
-	if (res.dataReturned()) {
-		int numfiles = res.rowsReturned();
-		for (int i=0; i < numfiles; i++) {
-			uint32_t pid=0, pver=0, lastmod=0;
-			string pname;
-			char *ptr;
-			ptr = res.getValue(i, 0);
-			pid = ntohl(*(uint32_t*)ptr);
-			ptr = res.getValue(i, 1);
-			pver = ntohl(*(uint32_t*)ptr);
-			pname = res.getValue(i, 2);
-			ptr = res.getValue(i, 3);
-			lastmod = ntohl(*(uint32_t*)ptr);
-			int datalen = res.getLength(i, 4);
-			char *data = res.getValue(i, 4);
-			DBFileInfoPtr filePtr;
-			if (filesById_.count(pid) > 0) {
-				filePtr = filesById_.at(pid);
-				filePtr->version = pver;
-				filePtr->name = pname;
-			} else {
-				filePtr = DBFileInfoPtr(new DBFileInfo(pid, pver, pname));
-				filesById_.insert(map<long,DBFileInfoPtr>::value_type(pid, filePtr));
-			}
-			//write data to disk
-			fs::path filepath(_impl->workingDir_);
-			filepath /= pname;
-			ofstream filest;
-			filest.open(filepath.string(), ios::out | ios::trunc | ios::binary);
-			filest.write(data, datalen);
-			filest.close();
-			//set modification time
-			struct utimbuf modbuf;
-			modbuf.actime = modbuf.modtime = lastmod;
-			utime(filepath.c_str(), &modbuf);
-		}
-	} else {
+	if (!res.dataReturned()) {
 		LOG(WARNING) << "sql error: " << res.errorMessage() << endl;
+		return;
+	}
+	int numfiles = res.rowsReturned();
+	for (int i=0; i < numfiles; i++) {
+		uint32_t pid = ntohl(*(uint32_t*)res.getValue(i, 0));
+		uint32_t pver = ntohl(*(uint32_t*)res.getValue(i, 1));
+		string pname = res.getValue(i, 2);
+		DBFileInfoPtr filePtr = _impl->fileInfoForRow(pid, pver, pname, filesById_);
+		filePtr->lastModified = ntohl(*(uint32_t*)res.getValue(i, 3));
+		filePtr->size = be64toh(*(uint64_t*)res.getValue(i, 4));
+		filePtr->materialized = false;
+		filePtr->cacheKey = FileCacheKey(pid, pver);
 	}
 }
 
+bool
+RC2::DBFileSource::copyFromCache(DBFileInfoPtr fobj)
+{
+	fs::path filepath(_impl->workingDir_);
+	filepath /= fobj->path;
+	if (!_impl->cache_ || !_impl->cache_->copyTo(fobj->cacheKey, filepath.string()))
+		return false;
+	_impl->setModificationTime(filepath, fobj->lastModified);
+	fobj->chunkHashes = _impl->fileChunkHashes(filepath);
+	fobj->size = fs::file_size(filepath);
+	fobj->materialized = true;
+	return true;
+}
+
+bool
+RC2::DBFileSource::materializeFile(DBFileInfoPtr fobj)
+{
+	dbcon_->finishAsync(); //a prefetch might be loading it
+	if (fobj->materialized)
+		return true;
+	if (copyFromCache(fobj))
+		return true;
+	loadFile(fobj->id);
+	return fobj->materialized;
+}
+
+void
+RC2::DBFileSource::loadFile(long fileId)
+{
+	string idStr = to_string(fileId);
+	const char *params[] = {idStr.c_str()};
+	DBResult res = dbcon_->executePrepared(kFileContentsStmt, params, NULL, NULL);
+	if (!res.dataReturned()) {
+		LOG(WARNING) << "sql error: " << res.errorMessage() << endl;
+		return;
+	}
+	if (res.rowsReturned() > 0)
+		writeFileRow(res, 0);
+}
+
+
+bool
+RC2::DBFileSource::fetchFileContents(DBFileInfoPtr fobj, function<void (DBResult&)> handler)
+{
+	if (copyFromCache(fobj))
+		return true;
+	dbcon_->sendPrepared(kFileContentsStmt, {to_string(fobj->id)}, {}, handler);
+	return false;
+}
+
+bool
+RC2::DBFileSource::storeFileContents(DBFileInfoPtr fobj, DBResult &res)
+{
+	if (!res.dataReturned()) {
+		LOG(WARNING) << "sql error: " << res.errorMessage() << endl;
+		return false;
+	}
+	if (res.rowsReturned() < 1)
+		return false;
+	writeFileRow(res, 0);
+	return fobj->materialized;
+}
 
 void
 RC2::DBFileSource::insertOrUpdateLocalFile(long fileId, long wspaceId)
 {
 	if (_impl->wspaceId_ != wspaceId)
 		return; //skip this file
-	ostringstream where;
-	where << "where f.id = " << fileId;
-	loadFiles(where.str().c_str());
+	loadFile(fileId);
 }
 
 void
@@ -189,47 +762,42 @@ RC2::DBFileSource::insertDBFile(string fname)
 {
 	string filePath = _impl->workingDir_ + "/" + fname;
 	LOG(INFO) << "insertDBFile(" << fname << ")" << endl;
-	DBTransaction trans = dbcon_->startTransaction();
-	long fileId = dbcon_->longFromQuery("select nextval('rcfile_seq'::regclass)");
-
-	DBFileInfoPtr fobj(new DBFileInfo(fileId, 1, fname));
-	if (stat(filePath.c_str(), &fobj->sb) == -1)
+	struct stat sb;
+	if (stat(filePath.c_str(), &sb) == -1)
 		throw runtime_error((format("stat failed for insert %s") % filePath).str());
-	time_t modTime = fobj->sb.st_mtime;
+	time_t modTime = sb.st_mtime;
 	size_t newSize=0;
 	unique_ptr<char[]> data = ReadFileBlob(filePath, newSize);
 	
-	string escapedName;
-	dbcon_->escapeLiteral(fname, escapedName);
-	ostringstream query;
-	query << "insert into rcfile (id, version, wspaceid"
-		<< ",name,filesize,lastmodified) values ("
-		<< fileId << ", 1, " << _impl->wspaceId_ << "," << escapedName << "," << newSize 
-		<< ", to_timestamp(" << modTime << "))";
-	DBResult res1 = dbcon_->executeQuery(query.str());
-	if (!res1.commandOK()) {
-		LOG(INFO) << "insert dbfile failed: " << res1.errorMessage() << endl;
-		throw FormattedException("failed to insert file %s: %s", fname.c_str(), res1.errorMessage());
-	}
-	query.clear();
-	query.str("");
-	query << "insert into rcfiledata (id, bindata) values (" << fileId << ", $1::bytea)";
-	int pformats[] = {1};
-	int pSizes[] = {(int)newSize};
-	const char *params[1] = {data.get()};
-	DBResult res2 = dbcon_->executeQuery(query.str(), 1, NULL, params, pSizes, pformats, 1);
-	if (!res2.commandOK()) {
-		LOG(INFO) << "executing query:" << query.str() << endl;
-		LOG(INFO) << "insert dbfiledata failed: " << res2.errorMessage() << endl;
-		throw FormattedException("failed to insert file %s: %s", fname.c_str(), res2.errorMessage());
+	//both inserts go in one round trip
+	long fileId = _impl->fileIds_.next(*writeCon_);
+	string idStr = to_string(fileId), wspaceStr = to_string(_impl->wspaceId_);
+	string sizeStr = to_string(newSize), modStr = to_string(modTime);
+	const char *fileParams[] = {idStr.c_str(), wspaceStr.c_str(), fname.c_str(), sizeStr.c_str(), modStr.c_str()};
+	int pformats[] = {0, 1};
+	int pSizes[] = {0, (int)newSize};
+	const char *params[] = {idStr.c_str(), data.get()};
+	vector<DBResult> results = writeCon_->executePipeline({
+		{&kInsertFileStmt, fileParams, NULL, NULL},
+		{&kInsertFileDataStmt, params, pSizes, pformats}
+	});
+	if (!results[0].commandOK()) {
+		LOG(INFO) << "insert dbfile failed: " << results[0].errorMessage() << endl;
+		throw FormattedException("failed to insert file %s: %s", fname.c_str(), results[0].errorMessage());
 	}
-	DBResult commitRes(trans.commit());
-	if (!commitRes.commandOK()) {
-		throw FormattedException("failed to commit file inserts %s: %s", fname.c_str(), 
-			commitRes.errorMessage());
+	if (!results[1].commandOK()) {
+		LOG(INFO) << "insert dbfiledata failed: " << results[1].errorMessage() << endl;
+		throw FormattedException("failed to insert file %s: %s", fname.c_str(), results[1].errorMessage());
 	}
-	//need to insert fobj
-	filesById_.insert(map<long,DBFileInfoPtr>::value_type(fileId, fobj));
+	DBFileInfoPtr fobj(new DBFileInfo(fileId, 1, fname));
+	fobj->sb = sb;
+	fobj->materialized = true;
+	fobj->size = newSize;
+	fobj->lastModified = modTime;
+	fobj->chunkHashes = FileChunkHashes(data.get(), newSize);
+	_impl->applyWhenCommitted([this, fobj]() {
+		filesById_.insert(map<long,DBFileInfoPtr>::value_type(fobj->id, fobj));
+	});
 	return fileId;
 }
 
@@ -240,49 +808,138 @@ RC2::DBFileSource::updateDBFile(DBFileInfoPtr fobj)
 
 	int newVersion = fobj->version + 1;
 	string filePath = _impl->workingDir_ + "/" + fobj->path;
-	if (stat(filePath.c_str(), &fobj->sb) == -1)
+	struct stat sb;
+	if (stat(filePath.c_str(), &sb) == -1)
 		throw runtime_error((format("stat failed for update %s") % fobj->name).str());
-	time_t newMod = fobj->sb.st_mtime;
+	time_t newMod = sb.st_mtime;
 	size_t newSize=0;
 	unique_ptr<char[]> data = ReadFileBlob(filePath, newSize);
+	vector<uint64_t> newHashes = FileChunkHashes(data.get(), newSize);
+	vector<pair<size_t, size_t>> runs;
+	bool sendChanges = _impl->changedChunkRuns(fobj, newHashes, newSize, runs);
 
-	DBTransaction trans = dbcon_->startTransaction();
-	ostringstream query;
-	query << "update rcfile set version = " << newVersion << ", lastmodified = to_timestamp("
-		<< newMod << "), filesize = " << newSize << " where id = " << fobj->id;
-	LOG(INFO) << "executing " << query.str() << endl;
-	DBResult res1 = dbcon_->executeQuery(query.str());
+	unique_ptr<DBTransaction> trans = _impl->startTransaction(writeCon_);
+	string versionStr = to_string(newVersion), modStr = to_string(newMod), sizeStr = to_string(newSize);
+	string idStr = to_string(fobj->id), oldVersionStr = to_string(fobj->version);
+	const char *fileParams[] = {versionStr.c_str(), modStr.c_str(), sizeStr.c_str(), idStr.c_str(), 
+		oldVersionStr.c_str()};
+	//changes are only valid against the version they were computed from
+	DBResult res1 = writeCon_->executePrepared(sendChanges ? kUpdateFileVersionStmt : kUpdateFileStmt, 
+		fileParams, NULL, NULL);
 	if (!res1.commandOK()) {
 		throw FormattedException("failed to update file %ld: %s", fobj->id, res1.errorMessage());
 	}
-	query.clear();
-	query.str("");
-	query << "update rcfiledata set bindata = $1::bytea where id = " << fobj->id;
-	int pformats[] = {1};
-	int pSizes[] = {(int)newSize};
-	const char *params[] = {data.get()};
-	DBResult res2 = dbcon_->executeQuery(query.str(), 1, NULL, params, pSizes, pformats);
-	if (!res2.commandOK()) {
-		throw FormattedException("failed to update file %ld: %s", fobj->id, res2.errorMessage());
+	if (sendChanges && res1.rowsAffected() < 1) {
+		LOG(INFO) << "file " << fobj->id << " changed in database, sending all of it" << endl;
+		sendChanges = false;
+		DBResult res = writeCon_->executePrepared(kUpdateFileStmt, fileParams, NULL, NULL);
+		if (!res.commandOK())
+			throw FormattedException("failed to update file %ld: %s", fobj->id, res.errorMessage());
 	}
-	DBResult commitRes(trans.commit());
-	if (!commitRes.commandOK()) {
-		throw FormattedException("failed to commit file updates %ld: %s", fobj->id, commitRes.errorMessage());
+	if (sendChanges) {
+		//only the last run can change the length, so earlier offsets stay valid
+		size_t oldSize = fobj->size;
+		//all the ranges are sent in one round trip
+		size_t numRuns = runs.size();
+		vector<string> rangeStrs;
+		rangeStrs.reserve(numRuns * 2);
+		vector<array<const char*, 4>> params(numRuns);
+		vector<array<int, 4>> pSizes(numRuns);
+		int pformats[] = {1, 0, 0, 0};
+		vector<PipelineStep> steps;
+		for (size_t i=0; i < numRuns; i++) {
+			size_t start = runs[i].first * kFileChunkSize;
+			size_t newEnd = min(runs[i].second * kFileChunkSize, newSize);
+			size_t oldEnd = min(runs[i].second * kFileChunkSize, oldSize);
+			rangeStrs.push_back(to_string(start + 1));
+			rangeStrs.push_back(to_string(oldEnd > start ? oldEnd - start : 0));
+			params[i] = {{data.get() + min(start, newSize), rangeStrs[i*2].c_str(), 
+				rangeStrs[i*2+1].c_str(), idStr.c_str()}};
+			pSizes[i] = {{(int)(newEnd > start ? newEnd - start : 0), 0, 0, 0}};
+			steps.push_back({&kOverlayFileDataStmt, params[i].data(), pSizes[i].data(), pformats});
+		}
+		for (auto &res : writeCon_->executePipeline(steps)) {
+			if (!res.commandOK())
+				throw FormattedException("failed to update file %ld: %s", fobj->id, res.errorMessage());
+		}
+		LOG(INFO) << "sent " << runs.size() << " changed ranges of " << fobj->name << endl;
+	} else {
+		int pformats[] = {1, 0};
+		int pSizes[] = {(int)newSize, 0};
+		const char *params[] = {data.get(), idStr.c_str()};
+		DBResult res2 = writeCon_->executePrepared(kUpdateFileDataStmt, params, pSizes, pformats);
+		if (!res2.commandOK()) {
+			throw FormattedException("failed to update file %ld: %s", fobj->id, res2.errorMessage());
+		}
+	}
+	if (trans) {
+		DBResult commitRes(trans->commit());
+		if (!commitRes.commandOK()) {
+			throw FormattedException("failed to commit file updates %ld: %s", fobj->id, commitRes.errorMessage());
+		}
 	}
-	fobj->version = newVersion;
+	//fobj may be a copy, so the update applies to whatever file has its id
+	long fileId = fobj->id;
+	_impl->applyWhenCommitted([this, fileId, sb, newVersion, newSize, newMod, newHashes]() {
+		auto itr = filesById_.find(fileId);
+		if (itr == filesById_.end())
+			return; //removed since
+		DBFileInfoPtr file = itr->second;
+		file->sb = sb;
+		file->version = newVersion;
+		file->size = newSize;
+		file->lastModified = newMod;
+		file->chunkHashes = newHashes;
+		file->cacheKey.clear(); //the new version's contents aren't in the cache
+	});
 }
 
 void 
 RC2::DBFileSource::removeDBFile(DBFileInfoPtr fobj) 
 {
-	ostringstream query;
-	query << "delete from rcfile where id = " << fobj->id;
-	DBResult res = dbcon_->executeQuery(query.str());
-	if (res.commandOK()) {
-		filesById_.erase(fobj->id);
-	} else {
-		LOG(WARNING) << "sql error delting file " << fobj->id << ":" 
-			<< res.errorMessage() << endl;
+	string idStr = to_string(fobj->id);
+	const char *params[] = {idStr.c_str()};
+	DBResult res = writeCon_->executePrepared(kDeleteFileStmt, params, NULL, NULL);
+	if (!res.commandOK()) {
+		throw FormattedException("failed to delete file %ld: %s", fobj->id, res.errorMessage());
 	}
+	long fileId = fobj->id;
+	_impl->applyWhenCommitted([this, fileId]() { filesById_.erase(fileId); });
+}
+
+void
+RC2::DBFileSource::setWriteConnection(shared_ptr<PGDBConnection> connection)
+{
+	writeCon_ = connection;
+}
+
+void
+RC2::DBFileSource::beginBatch()
+{
+	if (_impl->batch_)
+		throw runtime_error("batch already started");
+	_impl->batchUpdates_.clear();
+	_impl->batch_.reset(new DBTransaction(writeCon_->startTransaction()));
+}
+
+vector<function<void()>>
+RC2::DBFileSource::commitBatch()
+{
+	if (!_impl->batch_)
+		throw runtime_error("no batch started");
+	unique_ptr<DBTransaction> batch(std::move(_impl->batch_));
+	vector<function<void()>> updates;
+	updates.swap(_impl->batchUpdates_);
+	DBResult commitRes(batch->commit());
+	if (!commitRes.commandOK())
+		throw FormattedException("failed to commit file changes: %s", commitRes.errorMessage());
+	return updates;
+}
+
+void
+RC2::DBFileSource::rollbackBatch()
+{
+	_impl->batch_.reset(); //destructor rolls back
+	_impl->batchUpdates_.clear();
 }
 
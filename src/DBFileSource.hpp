@@ -2,20 +2,38 @@
 #include <string>
 #include <iostream>
 #include <map>
+#include <vector>
+#include <functional>
 #include <sys/stat.h>
 #include "../common/PGDBConnection.hpp"
+#include "FileManager.hpp"
+#include "BlobCodec.hpp"
 
 namespace RC2 {
 
+	extern const size_t kFileChunkSize;
+	//the hashes of each kFileChunkSize piece of data
+	std::vector<uint64_t> FileChunkHashes(const char *data, size_t length);
+
 	//for db fetched data
 	struct DBFileInfo {
 		long		id, version;
 		std::string	name, path;
 		int			watchDescriptor;
 		struct stat	sb;
+		//false until the contents have been written to the working directory
+		bool		materialized;
+		long		size;
+		//identifies the contents in the database in the FileCache. Empty if they aren't cached
+		std::string	cacheKey;
+		//hashes of each kFileChunkSize piece of the contents in the database, so an update
+		// only has to send the chunks that changed. Empty if unknown
+		std::vector<uint64_t>	chunkHashes;
+		time_t		lastModified;
 	
 		DBFileInfo(uint32_t anId, uint32_t aVersion, std::string &aName)
-			: id((long)anId), version((long)aVersion), name(aName)
+			: id((long)anId), version((long)aVersion), name(aName), watchDescriptor(-1),
+			  materialized(false), size(0), lastModified(0)
 		{
 			path += name;
 		}
@@ -28,6 +46,8 @@ namespace RC2 {
 
 
 	typedef std::shared_ptr<DBFileInfo> DBFileInfoPtr;
+	
+	class FileCache;
 
 	class DBFileSource {
 		public:
@@ -36,22 +56,63 @@ namespace RC2 {
 	
 			void	initializeSource(std::shared_ptr<PGDBConnection> connection, long wsid);
 			void	setWorkingDir(std::string workingDir);
+			void	setFileCache(std::shared_ptr<FileCache> cache);
+			//fetches and writes the contents of matching files
 			void	loadFiles(const char *whereClause);
+			void	loadFile(long fileId);
+			//only fetches information about matching files. Their contents are written by materializeFile()
+			void	loadFileMetadata(const char *whereClause);
+			//writes the file to the working directory if it isn't there yet. returns false on failure
+			bool	materializeFile(DBFileInfoPtr fobj);
+			//materializes fobj from the file cache and returns true, or sends the query for its
+			// contents without waiting and returns false. The handler is called from the event
+			// loop and should pass the result to storeFileContents()
+			bool	fetchFileContents(DBFileInfoPtr fobj, std::function<void (DBResult&)> handler);
+			bool	storeFileContents(DBFileInfoPtr fobj, DBResult &res);
 			
 			void	insertOrUpdateLocalFile(long fileId, long wspaceId);
 			void	removeLocalFile(long fileId);
 			
+			//file inserts, updates and removes use this connection. Defaults to the one
+			// passed to initializeSource()
+			void	setWriteConnection(std::shared_ptr<PGDBConnection> connection);
+			//update and remove change the entry in filesById_ with fobj's id, so fobj can be a copy
 			long	insertDBFile(std::string fname);
 			void	updateDBFile(DBFileInfoPtr fobj);
 			void	removeDBFile(DBFileInfoPtr fobj);
+			//inserts, updates and removes between these share one transaction. commitBatch()
+			// returns their changes to filesById_ instead of making them, so a batch can run on
+			// another thread and the thread that owns filesById_ applies them
+			void	beginBatch();
+			std::vector<std::function<void()>>	commitBatch();
+			void	rollbackBatch();
 			
+			//compresses .RData chunks and checkpoint variables. Other clients read file
+			// contents and the old single row .RData, so those are stored as is
+			void	setCodec(BlobCodec codec);
+			//true if saveRData() will compress .RData, so R doesn't need to
+			bool	compressesRData();
+			//saving .RData also discards any checkpoint, since it is now out of date
 			bool	loadRData();
 			void	saveRData();
 			
+			//a checkpoint stores each variable separately so only changed ones are sent
+			bool	checkpointAvailable();
+			void	saveCheckpoint(PGDBConnection &con, const std::vector<CheckpointVariable> &changed,
+								   const std::vector<std::string> &removed, bool replace);
+			bool	loadCheckpoint(std::function<void (const CheckpointVariable&)> handler);
+			
 		std::map<long, DBFileInfoPtr>	filesById_;
 
 		private:
+			//return false if a row lock timed out. With waitForLock there is no timeout
+			bool	saveRDataChunks(std::string filePath, bool waitForLock);
+			bool	saveLegacyRData(std::string filePath, bool waitForLock);
+			void	clearCheckpoint(PGDBConnection &con);
+			bool	copyFromCache(DBFileInfoPtr fobj);
+			void	writeFileRow(DBResult &res, int row);
 			std::shared_ptr<PGDBConnection> dbcon_;
+			std::shared_ptr<PGDBConnection> writeCon_;
 			class Impl;
 			std::unique_ptr<Impl>	_impl;
 	};
@@ -1,9 +1,13 @@
 //#include <algorithm>
 #include <vector>
+#include <cstring>
+#include <cstdint>
 #include <map>
+#include <set>
 #include <sys/time.h>
 #include "RC2Logging.h"
 #include "EnvironmentWatcher.hpp"
+#include "BinaryVariableWriter.hpp"
 #include "../common/RC2Utils.hpp"
 
 const int kMaxLen = 100;
@@ -13,6 +17,10 @@ const char *kClass = "class";
 const char *kValue = "value";
 const char *kName = "name";
 const char *kType = "type";
+const R_xlen_t kFullDigestBytes = 4096; //values this small are digested completely
+const R_xlen_t kDigestSampleBytes = 256; //larger ones sample this much at the start, middle and end
+const int kMaxDigestDepth = 2;
+const int kMaxFullDigestDepth = 32; //deep enough for the nesting in most function bodies
 
 namespace RC2 {
 void get_var_names(std::vector<Variable> &vars, std::vector<std::string> &names) {
@@ -26,6 +34,161 @@ bool compareVariablesByName(const Variable& v1, const Variable& v2) {
 }
 } //namespace RC2
 
+//mixes 8 bytes at a time so full digests of large vectors stay cheap
+inline void
+fnvAdd(uint64_t& hash, const void *data, size_t length) {
+	const unsigned char *bytes = static_cast<const unsigned char*>(data);
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, bytes + i, sizeof(word));
+		hash ^= word;
+		hash *= 1099511628211ULL;
+	}
+	for (; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+}
+
+//the element ranges of a vector of length elements that are included in a digest
+RC2::ElementRanges
+digestRanges(R_xlen_t length, size_t elementSize, bool full, bool &complete) {
+	RC2::ElementRanges ranges;
+	if (full || length * elementSize <= kFullDigestBytes) {
+		ranges.push_back(std::make_pair(0, length));
+	} else {
+		R_xlen_t count = kDigestSampleBytes / elementSize;
+		ranges.push_back(std::make_pair(0, count));
+		ranges.push_back(std::make_pair(length / 2, length / 2 + count));
+		ranges.push_back(std::make_pair(length - count, length));
+		complete = false;
+	}
+	return ranges;
+}
+
+void digestValue(uint64_t& hash, SEXP value, int depth, bool full, bool &complete);
+
+//a child digested completely is identified by its contents, otherwise by its address too
+inline void
+digestChild(uint64_t& hash, SEXP child, int depth, bool full, bool &complete) {
+	bool childComplete = depth > 0;
+	if (depth > 0)
+		digestValue(hash, child, depth - 1, full, childComplete);
+	if (!childComplete) {
+		fnvAdd(hash, &child, sizeof(child));
+		complete = false;
+	}
+}
+
+//the source of a closure, even after the jit has replaced its body with bytecode
+inline SEXP
+closureExpr(SEXP closure) {
+#if defined(R_VERSION) && R_VERSION >= R_Version(4,1,0)
+	return R_ClosureExpr(closure);
+#else
+	return BODY(closure);
+#endif
+}
+
+//complete is cleared if any part of value was sampled or skipped
+void
+digestValue(uint64_t& hash, SEXP value, int depth, bool full, bool &complete) {
+	static SEXP srcrefSymbol = Rf_install("srcref");
+	int type = TYPEOF(value);
+	fnvAdd(hash, &type, sizeof(type));
+	R_xlen_t length = Rf_isVector(value) ? XLENGTH(value) : 0;
+	fnvAdd(hash, &length, sizeof(length));
+	bool compact = false;
+#if defined(R_VERSION) && R_VERSION >= R_Version(3,5,0)
+	compact = ALTREP(value); //don't expand compact sequences just to digest them
+#endif
+	const void *data = nullptr;
+	size_t elementSize = 0;
+	switch(TYPEOF(value)) {
+		case NILSXP:
+		case SYMSXP: //symbols and primitives are never freed, so the address is enough
+		case SPECIALSXP:
+		case BUILTINSXP:
+			fnvAdd(hash, &value, sizeof(value));
+			break;
+		case LGLSXP: if (!compact) data = LOGICAL(value); elementSize = sizeof(int); break;
+		case INTSXP: if (!compact) data = INTEGER(value); elementSize = sizeof(int); break;
+		case REALSXP: if (!compact) data = REAL(value); elementSize = sizeof(double); break;
+		case CPLXSXP: if (!compact) data = COMPLEX(value); elementSize = sizeof(Rcomplex); break;
+		case RAWSXP: if (!compact) data = RAW(value); elementSize = 1; break;
+		case STRSXP:
+			//the characters, not the CHARSXP address, since a freed string's address can be reused
+			for (auto &range : digestRanges(length, sizeof(SEXP), full, complete)) {
+				for (R_xlen_t i=range.first; i < range.second; i++) {
+					SEXP str = STRING_ELT(value, i);
+					int strLen = str == NA_STRING ? -1 : LENGTH(str);
+					fnvAdd(hash, &strLen, sizeof(strLen));
+					if (strLen > 0)
+						fnvAdd(hash, CHAR(str), strLen);
+				}
+			}
+			break;
+		case VECSXP:
+		case EXPRSXP:
+			for (auto &range : digestRanges(length, sizeof(SEXP), full, complete)) {
+				for (R_xlen_t i=range.first; i < range.second; i++)
+					digestChild(hash, VECTOR_ELT(value, i), depth, full, complete);
+			}
+			break;
+		case LISTSXP:
+		case LANGSXP:
+			//arguments are walked along the cdr, so only nesting uses up depth
+			for (SEXP node = value; TYPEOF(node) == LISTSXP || TYPEOF(node) == LANGSXP; node = CDR(node)) {
+				SEXP tag = TAG(node);
+				fnvAdd(hash, &tag, sizeof(tag));
+				digestChild(hash, CAR(node), depth, full, complete);
+			}
+			break;
+		case CLOSXP: {
+			//a function's environment can change without its address changing. Global,
+			// package and namespace environments are only referenced when serialized
+			SEXP env = CLOENV(value);
+			fnvAdd(hash, &env, sizeof(env));
+			if (env != R_GlobalEnv && env != R_BaseEnv && env != R_EmptyEnv 
+				&& !R_IsNamespaceEnv(env) && !R_IsPackageEnv(env))
+			{
+				complete = false;
+			}
+			digestChild(hash, FORMALS(value), depth, full, complete);
+			digestChild(hash, closureExpr(value), depth, full, complete);
+			break;
+		}
+		default: //environments, promises, bytecode, external pointers, etc.
+			complete = false;
+			break;
+	}
+	if (compact)
+		complete = false;
+	if (data != nullptr) {
+		const char *bytes = static_cast<const char*>(data);
+		for (auto &range : digestRanges(length, elementSize, full, complete))
+			fnvAdd(hash, bytes + range.first * elementSize, (range.second - range.first) * elementSize);
+	}
+	for (SEXP attr = ATTRIB(value); attr != R_NilValue; attr = CDR(attr)) {
+		SEXP tag = TAG(attr), attrVal = CAR(attr);
+		fnvAdd(hash, &tag, sizeof(tag));
+		//a function's source reference holds its srcfile environment. It is replaced, not 
+		// modified, so its address is enough
+		if (type == CLOSXP && tag == srcrefSymbol)
+			fnvAdd(hash, &attrVal, sizeof(attrVal));
+		else
+			digestChild(hash, attrVal, depth, full, complete);
+	}
+}
+
+RC2::VariableIdentity::VariableIdentity ( SEXP value, bool full )
+	: sexp(value), type(TYPEOF(value)), length(Rf_isVector(value) ? XLENGTH(value) : 0), 
+	  attributes(ATTRIB(value)), digest(14695981039346656037ULL), complete(true)
+{
+	digestValue(digest, value, full ? kMaxFullDigestDepth : kMaxDigestDepth, full, complete);
+}
+
 inline bool isOrderedFactor(Rcpp::StringVector& classNames, RObject& robj) {
 	return classNames.length() > 1 && classNames[0] == "ordered" && classNames[1] == "factor";
 }
@@ -33,15 +196,15 @@ inline bool isOrderedFactor(Rcpp::StringVector& classNames, RObject& robj) {
 std::string
 columnType(RObject& robj, json& jobj, int colNum) {
 	if (Rf_isFactor(robj)) {
+		char namebuf[16];
+		snprintf(namebuf, 16, "f%d", colNum);
+		jobj[namebuf] = Rcpp::StringVector(robj.attr("levels"));
 		Rcpp::StringVector classVal(robj.attr(kClass));
 		if (isOrderedFactor(classVal, robj)) {
 			return "of";
 		} else {
 			return "f";
 		}
-		char namebuf[16];
-		snprintf(namebuf, 16, "f%d", colNum);
-		jobj[namebuf] = Rcpp::StringVector(robj.attr("levels"));
 	} else {
 		switch(robj.sexp_type()) {
 			case LGLSXP: return "b";
@@ -53,8 +216,101 @@ columnType(RObject& robj, json& jobj, int colNum) {
 	return "-";
 }
 
+//clamps a window to [0, total). limit < 0 uses defaultLimit, and a defaultLimit < 0 is everything
+std::pair<R_xlen_t, R_xlen_t>
+windowRange(int offset, int limit, int defaultLimit, R_xlen_t total) {
+	if (limit < 0)
+		limit = defaultLimit;
+	R_xlen_t start = std::min<R_xlen_t>(std::max(offset, 0), total);
+	R_xlen_t end = limit < 0 ? total : std::min<R_xlen_t>(start + limit, total);
+	return std::make_pair(start, end);
+}
+
+//describes what was returned when it is not the whole value
+void
+addWindow(json& jobj, std::pair<R_xlen_t, R_xlen_t> rows, R_xlen_t rowTotal) {
+	if (rows.first == 0 && rows.second == rowTotal)
+		return;
+	jobj["window"] = { {"offset", rows.first}, {"count", rows.second - rows.first} };
+}
+
+void
+addWindow(json& jobj, std::pair<R_xlen_t, R_xlen_t> rows, R_xlen_t rowTotal, 
+	std::pair<R_xlen_t, R_xlen_t> cols, R_xlen_t colTotal)
+{
+	if (rows.first == 0 && rows.second == rowTotal && cols.first == 0 && cols.second == colTotal)
+		return;
+	jobj["window"] = { {"offset", rows.first}, {"count", rows.second - rows.first},
+		{"colOffset", cols.first}, {"colCount", cols.second - cols.first} };
+}
+
+R_xlen_t
+rangesLength(const RC2::ElementRanges& ranges) {
+	R_xlen_t count = 0;
+	for (auto &range : ranges)
+		count += range.second - range.first;
+	return count;
+}
+
+//json has no NA, NaN or infinities. NA is null and the others are strings
+json
+doubleToJson(double d) {
+	if (ISNA(d)) return nullptr;
+	if (R_IsNaN(d)) return "NaN";
+	if (d == R_PosInf) return "Inf";
+	if (d == R_NegInf) return "-Inf";
+	return d;
+}
+
+//returns the elements in ranges as a json array
+json
+elementsToJson(RObject& robj, const RC2::ElementRanges& ranges) {
+	json jvals = json::array();
+	for (auto &range : ranges) {
+		for (R_xlen_t i = range.first; i < range.second; i++) {
+			switch(robj.sexp_type()) {
+				case LGLSXP: //logicalvector gets stored in json as ints, not bools. Convert manually
+					jvals.push_back(LOGICAL(robj)[i] == 0 ? false : true); 
+					break;
+				case INTSXP: jvals.push_back(INTEGER(robj)[i]); break;
+				case REALSXP: jvals.push_back(doubleToJson(REAL(robj)[i])); break;
+				case STRSXP: jvals.push_back(CHAR(STRING_ELT(robj, i))); break;
+				default:
+					jvals.push_back(nullptr);
+					break;
+			}
+		}
+	}
+	return jvals;
+}
+
+//returns robj itself if ranges cover all of it, otherwise a copy of just those elements
+RObject
+sliceVector(RObject& robj, const RC2::ElementRanges& ranges) {
+	R_xlen_t count = rangesLength(ranges);
+	if (count == XLENGTH(robj))
+		return robj;
+	RObject slice(Rf_allocVector(robj.sexp_type(), count));
+	R_xlen_t pos = 0;
+	for (auto &range : ranges) {
+		R_xlen_t len = range.second - range.first;
+		switch(robj.sexp_type()) {
+			case LGLSXP: memcpy(LOGICAL(slice) + pos, LOGICAL(robj) + range.first, len * sizeof(int)); break;
+			case INTSXP: memcpy(INTEGER(slice) + pos, INTEGER(robj) + range.first, len * sizeof(int)); break;
+			case REALSXP: memcpy(REAL(slice) + pos, REAL(robj) + range.first, len * sizeof(double)); break;
+			case CPLXSXP: memcpy(COMPLEX(slice) + pos, COMPLEX(robj) + range.first, len * sizeof(Rcomplex)); break;
+			case STRSXP:
+				for (R_xlen_t i=0; i < len; i++)
+					SET_STRING_ELT(slice, pos + i, STRING_ELT(robj, range.first + i));
+				break;
+		}
+		pos += len;
+	}
+	return slice;
+}
+
 RC2::EnvironmentWatcher::EnvironmentWatcher ( SEXP environ, ExecuteCallback callback )
-	: _env(environ), _execCallback(callback)
+	: _env(environ), _execCallback(callback), _binaryColumns(nullptr)
 {
 
 }
@@ -72,30 +328,51 @@ RC2::EnvironmentWatcher::captureEnvironment()
 	Rcpp::StringVector names(_env.ls(false));
 	//reorder values for easier comparison
 //	std::sort(names.begin(), names.end());
+	_lastIdentities.clear();
 	std::for_each(names.begin(), names.end(), [&](const char* aName) { 
 		std::string name(aName);
 		_lastVars.push_back(Variable(name, _env.get(name)));
+		_lastIdentities[name] = VariableIdentity(_lastVars.back().second);
 	});
 	std::sort(_lastVars.begin(), _lastVars.end(), compareVariablesByName);
 }
 
 json::value_type 
-RC2::EnvironmentWatcher::toJson ( std::string varName )
+RC2::EnvironmentWatcher::toJson ( std::string varName, const VariableWindow& window )
 {
 	json results;
 	Rcpp::RObject robj(_env.get(varName));
-	valueToJson(varName, robj, results, true);
+	valueToJson(varName, robj, results, true, window);
 	return results;
 }
 
+json::value_type 
+RC2::EnvironmentWatcher::toJson ( std::string varName, std::vector<RObject> &binaryColumns, 
+	const VariableWindow& window )
+{
+	_binaryColumns = &binaryColumns;
+	Defer clearColumns([this]() { _binaryColumns = nullptr; });
+	return toJson(varName, window);
+}
+
 json::value_type 
 RC2::EnvironmentWatcher::toJson()
 {
 	json results;
 	Rcpp::StringVector names(_env.ls(false));
+	std::set<std::string> nameSet;
 	std::for_each(names.begin(), names.end(), [&](const char* aName) { 
-		results[aName] = toJson(aName);
+		nameSet.insert(aName);
+		RObject robj(_env.get(aName));
+		results[aName] = cachedValueToJson(aName, robj, true);
 	});
+	//drop cached values of variables that no longer exist
+	for (auto it = _valueCache.begin(); it != _valueCache.end(); ) {
+		if (nameSet.count(it->first.first) == 0)
+			it = _valueCache.erase(it);
+		else
+			++it;
+	}
 	return results;
 }
 
@@ -123,59 +400,122 @@ RC2::EnvironmentWatcher::jsonDelta()
 	//figure out what was added
 	std::set_difference(newVars.begin(), newVars.end(),
 						_lastVars.begin(), _lastVars.end(), 
-						std::back_inserter(added));
+						std::back_inserter(added), compareVariablesByName);
+	//and what changed since it was captured
+	std::vector<std::string> modifiedNames;
+	std::for_each(newVars.begin(), newVars.end(), [&](Variable& aVar) {
+		auto last = _lastIdentities.find(aVar.first);
+		if (last != _lastIdentities.end() && last->second != VariableIdentity(aVar.second)) {
+			added.push_back(aVar);
+			modifiedNames.push_back(aVar.first);
+		}
+	});
 	//craft into json
 	std::vector<std::string> removedNames;
 	get_var_names(removed, removedNames);
-	json results, jsonAdded;
+	json results, jsonAdded = json::object();
 	results["removed"] = removedNames;
+	results["modified"] = modifiedNames;
 	std::for_each(added.begin(), added.end(), [&](Variable aVar) {
-		json varValue;
-		valueToJson(aVar.first, aVar.second, varValue, false);
-		jsonAdded[aVar.first] = varValue;
+		jsonAdded[aVar.first] = cachedValueToJson(aVar.first, aVar.second, false);
+	});
+	std::for_each(removedNames.begin(), removedNames.end(), [&](const std::string& aName) {
+		_valueCache.erase(std::make_pair(aName, false));
+		_valueCache.erase(std::make_pair(aName, true));
 	});
 	results["assigned"] = jsonAdded;
 	return results;
 }
 
-void
-RC2::EnvironmentWatcher::addSummary(std::string& varName, json& jobj)
+std::string
+RC2::EnvironmentWatcher::summary ( std::string varName )
 {
 	std::string vname = varName;
 	StripQuotes(vname);
+	auto cached = _summaryCache.find(vname);
+	VariableIdentity identity(_env.get(vname));
+	if (cached != _summaryCache.end() && cached->second.first == identity)
+		return cached->second.second;
 	std::string cmd = "capture.output(str(" + vname + "))";
 	RObject result;
-	_execCallback(cmd, result);
+	std::string summary;
+	if (!_execCallback(cmd, result)) {
+		LOG(INFO) << "failed to get summary of " << varName << std::endl;
+		return summary;
+	}
 	try {
 		Rcpp::StringVector strs(result);
-		std::string summary;
 		std::for_each(strs.begin(), strs.end(), [&](const char* str) { 
 			if (summary.length() > 0)
 				summary += "\n";
 			summary += str; 
 		});
-		jobj["summary"] = summary;
+		_summaryCache[vname] = std::make_pair(identity, summary);
 	} catch (...) {
 		LOG(INFO) << "exception for summary of " << varName << std::endl;
 	}
+	return summary;
+}
+
+json
+RC2::EnvironmentWatcher::cachedValueToJson ( const std::string& varName, RObject& robj, bool includeListChildren )
+{
+	//environments (and lists holding them) can change without their identity changing
+	bool cacheable = robj.sexp_type() != ENVSXP;
+	if (cacheable && robj.sexp_type() == VECSXP) {
+		R_xlen_t len = std::min<R_xlen_t>(XLENGTH(robj), kMaxLen);
+		for (R_xlen_t i=0; i < len && cacheable; i++)
+			cacheable = TYPEOF(VECTOR_ELT(robj, i)) != ENVSXP;
+	}
+	std::string name = varName;
+	json jobj;
+	if (!cacheable) {
+		valueToJson(name, robj, jobj, includeListChildren);
+		return jobj;
+	}
+	auto key = std::make_pair(varName, includeListChildren);
+	//a full digest, so unchanged large values and functions are reused too
+	VariableIdentity identity(robj, true);
+	auto cached = _valueCache.find(key);
+	if (identity.complete && cached != _valueCache.end() && cached->second.identity == identity)
+		return cached->second.serialized;
+	valueToJson(name, robj, jobj, includeListChildren);
+	//a local environment or compact vector can change unseen, so those aren't cached
+	if (!identity.complete) {
+		_valueCache.erase(key);
+		return jobj;
+	}
+	CachedValue &entry = _valueCache[key];
+	entry.identity = identity;
+	entry.serialized = jobj;
+	return jobj;
+}
+
+bool
+RC2::EnvironmentWatcher::addBinaryColumn ( RObject& robj, json& jobj, const ElementRanges& ranges )
+{
+	if (_binaryColumns == nullptr || !IsBinaryColumnType(robj))
+		return false;
+	jobj["binaryColumn"] = _binaryColumns->size();
+	_binaryColumns->push_back(sliceVector(robj, ranges));
+	return true;
 }
 
 void
-RC2::EnvironmentWatcher::valueToJson (std::string& varName, RObject& robj, json& jobj, bool includeListChildren )
+RC2::EnvironmentWatcher::valueToJson (std::string& varName, RObject& robj, json& jobj, bool includeListChildren,
+	const VariableWindow& window )
 {
 	jobj[kName] = varName;
 	if (Rf_isObject(robj)) {
-		setObjectData(robj, jobj);
-		addSummary(varName, jobj);
+		setObjectData(robj, jobj, window);
 		return;
 	}
 	switch(robj.sexp_type()) {
 		case VECSXP:
-			setListData(robj, jobj, includeListChildren);
-			addSummary(varName, jobj);
+			setListData(robj, jobj, includeListChildren, window);
 			break;
 		case ENVSXP:
-			setEnvironmentData(robj, jobj);
+			setEnvironmentData(robj, jobj, window);
 			break;
 		case CLOSXP: //3
 		case SPECIALSXP: //7
@@ -183,29 +523,33 @@ RC2::EnvironmentWatcher::valueToJson (std::string& varName, RObject& robj, json&
 			setFunctionData(robj, jobj);
 			break;
 		default:
-			setPrimitiveData(robj, jobj);
+			setPrimitiveData(robj, jobj, window);
 			break;
 	}
 }
 
 void
-RC2::EnvironmentWatcher::setListData ( RObject& robj, json& jobj, bool includeListChildren )
+RC2::EnvironmentWatcher::setListData ( RObject& robj, json& jobj, bool includeListChildren, 
+	const VariableWindow& window )
 {
-	int len = LENGTH(robj);
+	R_xlen_t len = XLENGTH(robj);
+	auto range = windowRange(window.offset, window.limit, kMaxLen, len);
 	jobj[kClass] = "list";
 	RObject names(robj.attr("names"));
-	json nameArray = rvectorToJsonArray(names);
+	json nameArray = nullptr;
+	if (names.sexp_type() == STRSXP)
+		nameArray = elementsToJson(names, ElementRanges{range});
 	jobj["names"] = nameArray;
 	jobj["length"] = len;
+	addWindow(jobj, range, len);
 	std::string emptyStr;
 	if (includeListChildren) {
 		json children;
-		int maxLen = len < kMaxLen ? len : kMaxLen;
-		for (int i=0; i < maxLen; i++) {
+		for (R_xlen_t i=range.first; i < range.second; i++) {
 			RObject aChild(VECTOR_ELT(robj, i));
 			json childObj;
 			valueToJson(emptyStr,  aChild, childObj, false);
-			childObj[kName] = nameArray[i];
+			childObj[kName] = nameArray.is_null() ? nullptr : nameArray[i - range.first];
 			children.push_back(childObj);
 		}
 		jobj[kValue] = children;
@@ -213,7 +557,7 @@ RC2::EnvironmentWatcher::setListData ( RObject& robj, json& jobj, bool includeLi
 }
 
 void 
-RC2::EnvironmentWatcher::setObjectData ( RObject& robj, json& jobj )
+RC2::EnvironmentWatcher::setObjectData ( RObject& robj, json& jobj, const VariableWindow& window )
 {
 	Rcpp::StringVector klazzNames(robj.attr(kClass));
 	if (isOrderedFactor(klazzNames, robj)) {
@@ -224,7 +568,7 @@ RC2::EnvironmentWatcher::setObjectData ( RObject& robj, json& jobj )
 	if (Rf_isS4(robj))
 		jobj["S4"] = true;
 	if (Rf_isFactor(robj)) {
-		setFactorData(robj, jobj);
+		setFactorData(robj, jobj, window);
 	} else if (jobj[kClass] == "Date") {
 		Rcpp::Date date(robj);
 		char datebuf[16];
@@ -239,32 +583,31 @@ RC2::EnvironmentWatcher::setObjectData ( RObject& robj, json& jobj )
 		jobj[kValue] = dt.getFractionalTimestamp();
 		jobj["type"] = "date";
 	}  else if (jobj[kClass] == "data.frame") {
-		setDataFrameData(robj, jobj);
+		setDataFrameData(robj, jobj, window);
 	} else {
 		setGenericObjectData(robj, jobj);
 	}
 }
 
 void 
-RC2::EnvironmentWatcher::setFactorData ( RObject& robj, json& jobj )
+RC2::EnvironmentWatcher::setFactorData ( RObject& robj, json& jobj, const VariableWindow& window )
 {
 	jobj["type"] = "f";
 	Rcpp::StringVector levs(robj.attr("levels"));
 	jobj["levels"] = levs;
-	jobj[kValue] = Rcpp::IntegerVector(robj);
+	R_xlen_t len = XLENGTH(robj);
+	auto range = windowRange(window.offset, window.limit, -1, len);
+	jobj[kValue] = elementsToJson(robj, ElementRanges{range});
+	addWindow(jobj, range, len);
 }
 
 void 
-RC2::EnvironmentWatcher::setDataFrameData ( RObject& robj, json& jobj )
+RC2::EnvironmentWatcher::setDataFrameData ( RObject& robj, json& jobj, const VariableWindow& window )
 {
 	int colCount = LENGTH(robj);
 	Rcpp::StringVector colNames(robj.attr("names"));
 	jobj["cols"] = colNames;
 	jobj["ncol"] = colCount;
-	RObject rowList(robj.attr("row.names"));
-	if (LENGTH(rowList) > 0) {
-		jobj["row.names"] = Rcpp::StringVector(rowList);
-	}
 	json colTypes;
 	std::vector<RObject> colObjs;
 	for (int i=0; i < colCount; i++) {
@@ -275,20 +618,51 @@ RC2::EnvironmentWatcher::setDataFrameData ( RObject& robj, json& jobj )
 		colTypes.push_back(columnType(element, jobj, i));
 	}
 	jobj["types"] = colTypes;
-	int rowCount = LENGTH(colObjs[0]);
+	R_xlen_t rowCount = colCount > 0 ? XLENGTH(colObjs[0]) : 0;
 	jobj["nrow"] = rowCount;
+	//binary columns default to every row, json to the first kMaxLen
+	auto rowRange = windowRange(window.offset, window.limit, _binaryColumns != nullptr ? -1 : kMaxLen, rowCount);
+	auto colRange = windowRange(window.colOffset, window.colLimit, -1, colCount);
+	addWindow(jobj, rowRange, rowCount, colRange, colCount);
+	RObject rowList(robj.attr("row.names"));
+	if (LENGTH(rowList) > 0) {
+		if (rowList.sexp_type() != INTSXP && rowList.sexp_type() != STRSXP)
+			rowList = Rf_coerceVector(rowList, STRSXP);
+		json rowNames = json::array();
+		for (R_xlen_t row=rowRange.first; row < rowRange.second; row++) {
+			if (rowList.sexp_type() == INTSXP)
+				rowNames.push_back(std::to_string(INTEGER(rowList)[row]));
+			else
+				rowNames.push_back(CHAR(STRING_ELT(rowList, row)));
+		}
+		jobj["row.names"] = rowNames;
+	}
+	if (_binaryColumns != nullptr) {
+		json binaryIndexes;
+		for (R_xlen_t col=colRange.first; col < colRange.second; col++) {
+			json colJson;
+			if (addBinaryColumn(colObjs[col], colJson, ElementRanges{rowRange})) {
+				binaryIndexes.push_back(colJson["binaryColumn"]);
+			} else {
+				LOG(WARNING) << "dataframe invalid col type:" << colObjs[col].sexp_type() << std::endl;
+				binaryIndexes.push_back(nullptr);
+			}
+		}
+		jobj["binaryColumns"] = binaryIndexes;
+		return;
+	}
 	//create robjs for each column list
 	json rows;
-	for (int row=0; row < kMaxLen && row < rowCount; row++) {
+	for (R_xlen_t row=rowRange.first; row < rowRange.second; row++) {
 		json aRow;
-		for (int col=0; col < colNames.length(); col++) {
+		for (R_xlen_t col=colRange.first; col < colRange.second; col++) {
 			RObject &val = colObjs[col];
 			switch(val.sexp_type()) {
 				case LGLSXP: aRow.push_back(LOGICAL(val)[row]); break;
 				case INTSXP: aRow.push_back(INTEGER(val)[row]); break;
-				case REALSXP: aRow.push_back(REAL(val)[row]); break;
+				case REALSXP: aRow.push_back(doubleToJson(REAL(val)[row])); break;
 				case STRSXP: 
-					aRow.push_back(Rcpp::StringVector(val)[0]); 
+					aRow.push_back(CHAR(STRING_ELT(val, row))); 
 					break;
 				default:
 					LOG(WARNING) << "dataframe invalid col type:" << val.sexp_type() << std::endl;
@@ -346,13 +720,13 @@ RC2::EnvironmentWatcher::setGenericObjectData ( RObject& robj, json& jobj )
 }
 
 void
-RC2::EnvironmentWatcher::setEnvironmentData ( RObject& robj, json& jobj )
+RC2::EnvironmentWatcher::setEnvironmentData ( RObject& robj, json& jobj, const VariableWindow& window )
 {
 	json childArray;
 	Rcpp::Environment cenv(robj);
 	Rcpp::StringVector cnames(cenv.ls(false));
-	int len = cnames.size() < kMaxLen ? cnames.size() : kMaxLen;
-	for (int i=0; i < len; i++) {
+	auto range = windowRange(window.offset, window.limit, kMaxLen, cnames.size());
+	for (R_xlen_t i=range.first; i < range.second; i++) {
 		json cobj;
 		std::string varName(cnames[i]);
 		cobj[kName] = varName;
@@ -361,12 +735,29 @@ RC2::EnvironmentWatcher::setEnvironmentData ( RObject& robj, json& jobj )
 		childArray.push_back(cobj);
 	}
 	jobj[kValue] = childArray;
+	jobj["length"] = cnames.size();
+	addWindow(jobj, range, cnames.size());
 }
 
 void 
-RC2::EnvironmentWatcher::setPrimitiveData ( RObject& robj, json& jobj )
+RC2::EnvironmentWatcher::setPrimitiveData ( RObject& robj, json& jobj, const VariableWindow& window )
 {
 	jobj[kPrimitive] = true; //override below if necessary
+	//matrices are windowed by row and column, other vectors by element
+	ElementRanges ranges;
+	R_xlen_t len = Rf_isVector(robj) ? XLENGTH(robj) : 0;
+	if (Rf_isMatrix(robj)) {
+		int nrow = Rf_nrows(robj), ncol = Rf_ncols(robj);
+		auto rowRange = windowRange(window.offset, window.limit, -1, nrow);
+		auto colRange = windowRange(window.colOffset, window.colLimit, -1, ncol);
+		for (R_xlen_t col=colRange.first; col < colRange.second; col++)
+			ranges.push_back(std::make_pair(col * nrow + rowRange.first, col * nrow + rowRange.second));
+		addWindow(jobj, rowRange, nrow, colRange, ncol);
+	} else {
+		auto range = windowRange(window.offset, window.limit, -1, len);
+		ranges.push_back(range);
+		addWindow(jobj, range, len);
+	}
 	bool notVector = false;
 	switch(robj.sexp_type()) {
 		case NILSXP: //0
@@ -377,43 +768,34 @@ RC2::EnvironmentWatcher::setPrimitiveData ( RObject& robj, json& jobj )
 		case LGLSXP: //10
 			jobj[kClass] = "logical";
 			jobj[kType] = "b";
-			{ //logicalvector gets stored in json as ints, not bools. Convert manually
-				Rcpp::LogicalVector logics(robj);
-				std::vector<bool> vals;
-				std::for_each(logics.begin(), logics.end(), [&](int aVal) { vals.push_back(aVal == 0 ? false : true); });
-				jobj[kValue] = vals;
-			}
+			if (!addBinaryColumn(robj, jobj, ranges))
+				jobj[kValue] = elementsToJson(robj, ranges);
 			break;
 		case INTSXP: //13
 			jobj[kClass] = "integer vector";
 			jobj[kType] = "i";
-			jobj[kValue] = Rcpp::IntegerVector(robj);
+			if (!addBinaryColumn(robj, jobj, ranges))
+				jobj[kValue] = elementsToJson(robj, ranges);
 			break;
 		case REALSXP: //14
 			jobj[kClass] = "numeric vector";
 			jobj[kType] = "d";
-			{
-				Rcpp::NumericVector dvals(robj);
-				json jvals;
-				std::for_each(dvals.begin(), dvals.end(), [&](double d) 
-				{
-					if (d == R_NaN) jvals.push_back("NaN");
-					else if (d == R_PosInf) jvals.push_back("Inf");
-					else if (d == R_NegInf) jvals.push_back("-Inf");
-					else jvals.push_back(d);
-				});
-				jobj[kValue] = jvals;
-			}
+			if (!addBinaryColumn(robj, jobj, ranges))
+				jobj[kValue] = elementsToJson(robj, ranges);
 			break;
 		case STRSXP: //16
 			jobj[kClass] = "string";
 			jobj[kType] = "s";
-			jobj[kValue] = Rcpp::StringVector(robj);
+			if (!addBinaryColumn(robj, jobj, ranges))
+				jobj[kValue] = elementsToJson(robj, ranges);
 			break;
 		case CPLXSXP:
 			jobj[kClass] = "complex";
 			jobj[kType] = "c";
-			jobj[kValue] = Rcpp::StringVector(robj);
+			{
+				RObject strs(Rf_coerceVector(sliceVector(robj, ranges), STRSXP));
+				jobj[kValue] = Rcpp::StringVector(strs);
+			}
 			break;
 		case RAWSXP: //24
 			jobj[kClass] = "raw";
@@ -434,7 +816,7 @@ RC2::EnvironmentWatcher::setPrimitiveData ( RObject& robj, json& jobj )
 	if (notVector)
 		jobj[kNotAVector] = true;
 	else
-		jobj["length"] = LENGTH(robj);
+		jobj["length"] = len;
 	if (Rf_isArray(robj)) {
 		jobj[kPrimitive] = false;
 		setDimNames(robj, jobj);
@@ -11,6 +11,41 @@ using Rcpp::RObject;
 
 namespace RC2 {
 	typedef std::pair<std::string, RObject> Variable;
+	//[start, end) element index ranges of a vector
+	typedef std::vector<std::pair<R_xlen_t, R_xlen_t>> ElementRanges;
+	
+	//a cheap fingerprint of a value used to tell if it changed without serializing it. The
+	// digest covers small values completely and samples large ones unless full is set, so
+	// it catches most in place modification that leaves the address the same. Functions are
+	// digested by their formals and source.
+	struct VariableIdentity {
+		SEXP sexp;
+		int type;
+		R_xlen_t length;
+		SEXP attributes;
+		uint64_t digest;
+		//the digest covered all of the value, so equal identities mean equal contents
+		bool complete;
+		VariableIdentity() : sexp(nullptr), type(-1), length(0), attributes(nullptr), digest(0), complete(false) {}
+		explicit VariableIdentity(SEXP value, bool full = false);
+		bool operator==(const VariableIdentity& other) const {
+			//complete digests cover the contents, so a copy at another address is equal
+			if (complete && other.complete)
+				return type == other.type && length == other.length && digest == other.digest;
+			return sexp == other.sexp && type == other.type && length == other.length
+				&& attributes == other.attributes && digest == other.digest;
+		}
+		bool operator!=(const VariableIdentity& other) const { return !(*this == other); }
+	};
+	
+	//the part of a value to return. offset/limit are elements of a vector, rows of a matrix
+	// or data frame, or children of a list or environment. A limit < 0 uses the default
+	// for that type of value.
+	struct VariableWindow {
+		int offset, limit, colOffset, colLimit;
+		VariableWindow(int off=0, int lim=-1, int colOff=0, int colLim=-1)
+			: offset(off), limit(lim), colOffset(colOff), colLimit(colLim) {}
+	};
 	
 class EnvironmentWatcher : private boost::noncopyable {
 public:
@@ -18,32 +53,56 @@ public:
 	~EnvironmentWatcher();
 
 	json::value_type toJson();
-	json::value_type toJson(std::string varName);
+	json::value_type toJson(std::string varName, const VariableWindow& window = VariableWindow());
+	//vectors and data frame columns are not put in the json. Instead they are appended to
+	// binaryColumns and referenced by index via "binaryColumn"/"binaryColumns"
+	json::value_type toJson(std::string varName, std::vector<RObject> &binaryColumns, 
+		const VariableWindow& window = VariableWindow());
+	//names that were removed, names of existing variables that were "modified", and
+	// the values of new and modified variables as "assigned"
 	json::value_type jsonDelta();
 	
+	//the output of str() for a variable. Generating it means evaluating R code, so it is
+	// only done on request and cached until the variable changes.
+	std::string summary(std::string varName);
+	
 	void captureEnvironment();
-	void clear() { _lastVars.erase(_lastVars.begin(), _lastVars.end()); }
+	void clear() { _lastVars.clear(); _lastIdentities.clear(); _summaryCache.clear(); _valueCache.clear(); }
 	
 protected:
 	Rcpp::Environment _env;
+	//values are held so their addresses can not be reused before the next capture
 	std::vector<Variable> _lastVars;
+	std::map<std::string, VariableIdentity> _lastIdentities;
+	std::map<std::string, std::pair<VariableIdentity, std::string>> _summaryCache;
+	//serialized variables keyed on name and includeListChildren. Only values with a complete
+	// identity are cached, so the value doesn't have to be held to keep its address unique
+	struct CachedValue {
+		VariableIdentity identity;
+		json serialized;
+	};
+	std::map<std::pair<std::string, bool>, CachedValue> _valueCache;
 	ExecuteCallback _execCallback;
+	std::vector<RObject>* _binaryColumns;
 	
-	void valueToJson(std::string& varName, RObject& robj, json& jobj, bool includeListChildren=false);
+	void valueToJson(std::string& varName, RObject& robj, json& jobj, bool includeListChildren=false, 
+		const VariableWindow& window = VariableWindow());
+	//valueToJson that reuses the previous result if the variable has not changed
+	json cachedValueToJson(const std::string& varName, RObject& robj, bool includeListChildren);
 	//returns array
 	json rvectorToJsonArray(RObject& robj);
 	
-	void setObjectData(RObject& robj, json& jobj);
-	void setFactorData(RObject& robj, json& jobj);
-	void setDataFrameData(RObject& robj, json& jobj);
+	void setObjectData(RObject& robj, json& jobj, const VariableWindow& window);
+	void setFactorData(RObject& robj, json& jobj, const VariableWindow& window);
+	void setDataFrameData(RObject& robj, json& jobj, const VariableWindow& window);
 	void setGenericObjectData(RObject& robj, json& jobj);
-	void setEnvironmentData(RObject& robj, json& jobj);
+	void setEnvironmentData(RObject& robj, json& jobj, const VariableWindow& window);
 	void setFunctionData(RObject& robj, json& jobj);
-	void setPrimitiveData(RObject& robj, json& jobj);
+	void setPrimitiveData(RObject& robj, json& jobj, const VariableWindow& window);
 	void setDimNames(RObject& robj, json& jobj);
-	void setListData(RObject& robj, json& jobj, bool includeListChildren);
+	void setListData(RObject& robj, json& jobj, bool includeListChildren, const VariableWindow& window);
 	
-	void addSummary(std::string& varName, json& jobj);
+	bool addBinaryColumn(RObject& robj, json& jobj, const ElementRanges& ranges);
 };
 
 	
@@ -0,0 +1,166 @@
+#include "FileCache.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <utime.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <vector>
+#include <algorithm>
+#define BOOST_NO_CXX11_SCOPED_ENUMS
+#include <boost/filesystem.hpp>
+#include "common/RC2Utils.hpp"
+#include "../common/FormattedException.hpp"
+#include "RC2Logging.h"
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+const uint64_t RC2::FileCache::kDefaultMaxBytes = 2ULL * 1024 * 1024 * 1024;
+//entries being written have this in their name and are never evicted or returned
+static const char *kPartialMarker = ".partial-";
+
+string
+RC2::FileCacheKey(long fileId, long version)
+{
+	return to_string(fileId) + "-" + to_string(version);
+}
+
+RC2::FileCache::FileCache(string cacheDir, uint64_t maxBytes)
+	: _cacheDir(cacheDir), _maxBytes(maxBytes), _knownBytes(UINT64_MAX)
+{
+	//entries are copied into workspaces, so only the user sessions run as may add them
+	fs::path parent = fs::path(_cacheDir).parent_path();
+	if (!parent.empty() && !fs::is_directory(parent) && MakeDirectoryPath(parent.string(), 0755) != 0)
+		throw FormattedException("failed to create %s", parent.string().c_str());
+	if (mkdir(_cacheDir.c_str(), 0700) != 0 && errno != EEXIST)
+		throw FormattedException("failed to create file cache %s: %s", _cacheDir.c_str(), strerror(errno));
+	struct stat sb;
+	if (lstat(_cacheDir.c_str(), &sb) != 0 || !S_ISDIR(sb.st_mode))
+		throw FormattedException("file cache %s is not a directory", _cacheDir.c_str());
+	if (sb.st_uid != geteuid())
+		throw FormattedException("file cache %s is owned by another user", _cacheDir.c_str());
+	if ((sb.st_mode & 0077) != 0)
+		restrictAccess();
+}
+
+//a cache created by an older version was writable by anyone, so its entries can't be trusted
+void
+RC2::FileCache::restrictAccess()
+{
+	LOG(WARNING) << "restricting access to file cache " << _cacheDir;
+	if (chmod(_cacheDir.c_str(), 0700) != 0)
+		throw FormattedException("failed to restrict file cache %s: %s", _cacheDir.c_str(), strerror(errno));
+	boost::system::error_code ec;
+	for (fs::directory_iterator itr(_cacheDir, ec), end; !ec && itr != end; itr.increment(ec)) {
+		struct stat sb;
+		if (lstat(itr->path().c_str(), &sb) != 0 || sb.st_uid != geteuid() || !S_ISREG(sb.st_mode))
+			fs::remove_all(itr->path(), ec);
+	}
+}
+
+string
+RC2::FileCache::pathForKey(const string &key) const
+{
+	return _cacheDir + "/" + key;
+}
+
+bool
+RC2::FileCache::cloneFile(const string &srcPath, const string &destPath)
+{
+	int src = open(srcPath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (src == -1)
+		return false;
+	Defer closeSrc([src]() { close(src); });
+	int dest = open(destPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (dest == -1)
+		return false;
+	int rc = ioctl(dest, FICLONE, src);
+	close(dest);
+	if (rc == 0)
+		return true;
+	//not a filesystem that supports reflinks, or a different filesystem
+	boost::system::error_code ec;
+	fs::copy_file(srcPath, destPath, fs::copy_option::overwrite_if_exists, ec);
+	return !ec;
+}
+
+bool
+RC2::FileCache::copyTo(const string &key, const string &destPath)
+{
+	if (key.empty())
+		return false;
+	string entryPath = pathForKey(key);
+	if (!cloneFile(entryPath, destPath))
+		return false;
+	//the modification time of an entry is when it was last used
+	utime(entryPath.c_str(), nullptr);
+	return true;
+}
+
+void
+RC2::FileCache::add(const string &key, const string &srcPath)
+{
+	if (key.empty())
+		return;
+	string finalPath = pathForKey(key);
+	if (fs::exists(finalPath)) {
+		utime(finalPath.c_str(), nullptr);
+		return;
+	}
+	//write to a unique name and rename so other sessions only see complete entries
+	string tmpPath = finalPath + kPartialMarker + GenerateUUID();
+	if (!cloneFile(srcPath, tmpPath) || rename(tmpPath.c_str(), finalPath.c_str()) != 0) {
+		LOG(WARNING) << "failed to add " << key << " to file cache";
+		unlink(tmpPath.c_str());
+		return;
+	}
+	//the directory is only scanned when this process's view of its size crosses the limit
+	if (_knownBytes == UINT64_MAX) {
+		_knownBytes = evict(); //includes the new entry
+		return;
+	}
+	boost::system::error_code ec;
+	_knownBytes += fs::file_size(finalPath, ec);
+	if (_knownBytes > _maxBytes)
+		_knownBytes = evict();
+}
+
+//if the cache is over its maximum size, removes the least recently used entries until it
+// is at 90%. Returns the resulting size. Other sessions may be evicting at the same time,
+// so missing files are not errors.
+uint64_t
+RC2::FileCache::evict()
+{
+	struct Entry {
+		fs::path path;
+		uintmax_t size;
+		time_t lastUse;
+	};
+	vector<Entry> entries;
+	uintmax_t total = 0;
+	boost::system::error_code ec;
+	for (fs::directory_iterator itr(_cacheDir, ec), end; !ec && itr != end; itr.increment(ec)) {
+		if (itr->path().filename().string().find(kPartialMarker) != string::npos)
+			continue;
+		boost::system::error_code statErr;
+		Entry entry = { itr->path(), fs::file_size(itr->path(), statErr), 
+			fs::last_write_time(itr->path(), statErr) };
+		if (statErr)
+			continue;
+		total += entry.size;
+		entries.push_back(entry);
+	}
+	if (total <= _maxBytes)
+		return total;
+	sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.lastUse < b.lastUse; });
+	uintmax_t target = _maxBytes / 10 * 9;
+	for (auto itr = entries.begin(); itr != entries.end() && total > target; ++itr) {
+		fs::remove(itr->path, ec);
+		total -= itr->size;
+	}
+	return total;
+}
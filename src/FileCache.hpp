@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+namespace RC2 {
+
+	//file ids are unique across workspaces and every change makes a new version, so this
+	// identifies contents without the database having to hash them
+	std::string FileCacheKey(long fileId, long version);
+
+	//A directory of file contents shared by all rsessions on a node so the same contents
+	// only have to be fetched from the database once, even when several sessions open the
+	// same workspace. Entries are keyed by FileCacheKey() and published with rename(),
+	// so a session never sees a partially written file. When the cache grows past maxBytes
+	// the least recently used entries are removed.
+	class FileCache {
+	public:
+		//the directory is created with mode 0700. Throws if it exists and belongs to another user
+		FileCache(std::string cacheDir, uint64_t maxBytes = kDefaultMaxBytes);
+		
+		static const uint64_t kDefaultMaxBytes;
+		
+		std::string	cacheDir() const { return _cacheDir; }
+		//reflinks (or copies, if the filesystem can't) the entry for key to destPath. 
+		// Hard links are not used because R writes files in place. returns false if there is no such entry
+		bool		copyTo(const std::string &key, const std::string &destPath);
+		//adds a copy of the file at srcPath as the entry for key
+		void		add(const std::string &key, const std::string &srcPath);
+		
+	private:
+		std::string	_cacheDir;
+		uint64_t	_maxBytes;
+		//size of the cache as of the last scan plus what this process added since. Other
+		// sessions' additions are seen at the next scan. UINT64_MAX until the first scan
+		uint64_t	_knownBytes;
+		std::string	pathForKey(const std::string &key) const;
+		bool		cloneFile(const std::string &srcPath, const std::string &destPath);
+		void		restrictAccess();
+		uint64_t	evict();
+	};
+
+};
@@ -6,8 +6,10 @@
 #include <map>
 #include <dirent.h>
 #include <fcntl.h>
+#include <arpa/inet.h>
 #include <sys/inotify.h>
 #include <event2/bufferevent.h>
+#include <event2/buffer.h>
 #include <postgresql/libpq-fe.h>
 #define BOOST_NO_CXX11_SCOPED_ENUMS
 #include <boost/filesystem.hpp>
@@ -20,7 +22,10 @@
 #include "../common/FormattedException.hpp"
 #include "common/RC2Utils.hpp"
 #include "common/ZeroInitializedStruct.hpp"
+#include "common/SequenceAllocator.hpp"
 #include "DBFileSource.hpp"
+#include "FileCache.hpp"
+#include "IOWorker.hpp"
 
 using namespace std;
 using boost::format;
@@ -49,6 +54,36 @@ struct PendingImage {
 
 using PendingImageMap = map<int,PendingImage>;
 
+//$1 is a text int4[] of ids and $4 a binary bytea[] of the same length
+static const RC2::PreparedQuery kInsertImagesStmt = {"rc2_insert_images", 
+	"insert into sessionimage (id, sessionid, batchid, name, imgdata) "
+	"select t.id, $2::int4, $3::int4, 'img' || t.id || '.png', t.data "
+	"from unnest($1::int4[], $4::bytea[]) as t(id, data)", 4};
+static const RC2::PreparedQuery kNextImageBatchStmt = {"rc2_next_image_batch", 
+	"select coalesce(max(batchid), 0) + 1 from sessionimage where sessionid = $1::int4", 1};
+
+//images are uploaded by this many threads, each inserting up to kImageBatchSize per statement
+const int kImageUploadWorkers = 2;
+const size_t kImageBatchSize = 16;
+
+//an upload thread. ids is only used by its jobs and is declared first so it outlives them
+struct ImageUploader {
+	RC2::SequenceAllocator				ids{"sessionimage_seq"};
+	unique_ptr<RC2::IOWorker>		worker;
+};
+
+//file changes are collected for this long and then sent to the database together
+const struct timeval kSyncDelay = {0, 250000};
+//a change that keeps failing on its own is dropped after this many attempts
+const int kMaxSyncAttempts = 5;
+
+enum class PendingChangeType { Insert, Update, Remove };
+
+struct PendingChange {
+	PendingChangeType type;
+	long fileId; //0 for inserts
+};
+
 class RC2::FileManager::Impl : public ZeroInitializedClass {
 	public:
 		long						wspaceId_;
@@ -61,7 +96,24 @@ class RC2::FileManager::Impl : public ZeroInitializedClass {
 		PendingImageMap				pendingImagesByWatchDesc_;
 		vector<long>				imageIds_;
 		string						workingDir;
+		string						fileCacheDir_;
+		uint64_t					fileCacheMaxBytes_;
 		struct event_base*			eventBase_;
+		struct event*				prefetchEvent_;
+		set<long>					prefetchFailures_;
+		unique_ptr<IOWorker>		ioWorker_;
+		vector<unique_ptr<ImageUploader>>	imageUploaders_;
+		string						imageConnectString_; //uploaders connect on the first flush
+		size_t						nextImageUploader_;
+		SequenceAllocator			imageIdAllocator_{"sessionimage_seq"}; //without uploaders
+		vector<pair<string, long>>	imageQueue_; //paths waiting for flushImages() and their order
+		set<string>					retriedImages_; //failed once and queued again
+		long						imageUploadSeq_;
+		map<long, long>				uploadedImages_; //ids by queue order, so they keep plot order
+		map<string, PendingChange>	pendingChanges_; //by file name
+		map<string, int>			syncFailures_; //failed attempts by file name
+		bool						syncInFlight_;
+		struct event*				syncEvent_;
 		struct bufferevent*			inotifyEvent_;
 		int							inotifyFd_;
 		FSDirectory					rootDir_;
@@ -75,11 +127,36 @@ class RC2::FileManager::Impl : public ZeroInitializedClass {
 
 		void cleanup(); //replacement for destructor
 		void connect(std::shared_ptr<PGDBConnection> connection, long wspaceId, long sessionRecId);
-		long insertImage(string fname, string imgNumStr);
+		void	queueImage(string fname);
+		void	startImageUploaders();
+		void	flushImages();
+		void	requeueImages(const vector<pair<string, long>> &images);
+		void	waitForImages();
 		bool executeDBCommand(string cmd);
 		
 		unique_ptr<char[]> readFileBlob(DBFileInfoPtr fobj, size_t &size);
 		bool fileExistsWithName(string fname);
+		DBFileInfoPtr fileWithName(string fname);
+		
+		bool	materialize(DBFileInfoPtr file);
+		void	adoptLocalFile(DBFileInfoPtr file);
+		void	schedulePrefetch();
+		void	runIO(IOWorker::Job job, IOWorker::Completion completion = nullptr);
+		void	waitForIO();
+		void	queueChange(string fname, PendingChangeType type, long fileId);
+		void	scheduleSync();
+		void	requeueChanges(const map<string, PendingChange> &failed);
+		void	syncPendingChanges();
+		static void handleSyncEvent(int fd, short event_type, void *ctx)
+		{
+			reinterpret_cast<Impl*>(ctx)->syncPendingChanges();
+		}
+		void	prefetchNextFile();
+		void	prefetchFetched(DBFileInfoPtr file, DBResult &res);
+		static void handlePrefetch(int fd, short event_type, void *ctx)
+		{
+			reinterpret_cast<Impl*>(ctx)->prefetchNextFile();
+		}
 
 		void	setupInotify(FileManager *fm);
 		void 	watchFile(DBFileInfoPtr file);
@@ -130,8 +207,17 @@ class RC2::FileManager::Impl : public ZeroInitializedClass {
 
 void
 RC2::FileManager::Impl::cleanup() {
+	waitForIO(); //a sync in flight would only reschedule this one
+	syncPendingChanges();
+	flushImages();
+	imageUploaders_.clear(); //waits for pending uploads
+	ioWorker_.reset(); //waits for pending jobs
 	if (inotifyFd_ != -1)
 		close(inotifyFd_);
+	if (prefetchEvent_ != nullptr)
+		event_free(prefetchEvent_);
+	if (syncEvent_ != nullptr)
+		event_free(syncEvent_);
 }
 
 void
@@ -140,47 +226,180 @@ RC2::FileManager::Impl::connect(std::shared_ptr<PGDBConnection> connection, long
 	wspaceId_ = wspaceId;
 	sessionRecId_ = sessionRecId;
 	dbConnection_ = connection;
+	dbConnection_->setEventBase(eventBase_);
 	char msg[255];
 	dbFileSource_->initializeSource(dbConnection_, wspaceId_);
+	if (fileCacheDir_.length() > 0) {
+		try {
+			dbFileSource_->setFileCache(make_shared<FileCache>(fileCacheDir_, fileCacheMaxBytes_));
+		} catch (exception &e) {
+			LOG(WARNING) << "not using file cache: " << e.what();
+		}
+	}
+	//contents are written on first use or by the background prefetch
 	snprintf(msg, 255, "where wspaceid = %ld", wspaceId_);
-	dbFileSource_->loadFiles(msg);
+	dbFileSource_->loadFileMetadata(msg);
 	sessionImageBatch_ = 0;
 }
 
-long
-RC2::FileManager::Impl::insertImage(string fname, string imgNumStr)
+//reads the images and inserts them with one statement. imageIds gets the id of each
+// image, or 0 if it had no data
+static void
+insertImages(RC2::PGDBConnection &con, RC2::SequenceAllocator &ids, long sessionId, long batchId, 
+	const vector<pair<string, long>> &images, vector<long> &imageIds)
 {
-	string filePath = workingDir + "/" + fname;
-	size_t size;
-	unique_ptr<char[]> buffer = ReadFileBlob(filePath, size);
-	if (size < 1) {
-		LOG(INFO) << "got image with no data";
-		return 0;
+	//binary array header: 1 dimension, no nulls, bytea elements, then its length and lower bound
+	string dataArray(20, '\0');
+	uint32_t header[] = {htonl(1), htonl(0), htonl(17), 0, htonl(1)};
+	string idArray = "{";
+	uint32_t count = 0;
+	for (auto &image : images) {
+		size_t size;
+		unique_ptr<char[]> buffer = RC2::ReadFileBlob(image.first, size);
+		if (size < 1) {
+			LOG(INFO) << "got image with no data";
+			imageIds.push_back(0);
+			continue;
+		}
+		long imgId = ids.next(con);
+		idArray += (count++ == 0 ? "" : ",") + to_string(imgId);
+		imageIds.push_back(imgId);
+		uint32_t beSize = htonl(size);
+		dataArray.append((char*)&beSize, sizeof(beSize));
+		dataArray.append(buffer.get(), size);
 	}
-	long imgId = dbConnection_->longFromQuery("select nextval('sessionimage_seq'::regclass)");
-	if (imgId <= 0)
-		throw FormattedException("failed to get session image id");
-	if (sessionImageBatch_ <= 0) {
-		stringstream batchq;
-		batchq << "select max(batchid) from sessionimage where sessionid = " << sessionRecId_;
-		sessionImageBatch_ = dbConnection_->longFromQuery(batchq.str().c_str()) + 1;
-	}
-	stringstream query;
-	query << "insert into sessionimage (id,sessionid,batchid,name,imgdata) values (" << imgId 
-		<< "," << sessionRecId_ << "," << sessionImageBatch_ << ",'img" << imgId << ".png',$1::bytea)";
-	int pformats = 1;
-	int pSizes[] = {(int)size};
- 	const char *params[] = {buffer.get()};
-	DBResult res = dbConnection_->executeQuery(query.str(), 1, NULL, params, pSizes, &pformats);
+	idArray += "}";
+	if (count == 0)
+		return;
+	header[3] = htonl(count);
+	memcpy(&dataArray[0], header, sizeof(header));
+	string sessionStr = to_string(sessionId), batchStr = to_string(batchId);
+	int pformats[] = {0, 0, 0, 1};
+	int pSizes[] = {0, 0, 0, (int)dataArray.length()};
+	const char *params[] = {idArray.c_str(), sessionStr.c_str(), batchStr.c_str(), dataArray.data()};
+	DBResult res = con.executePrepared(kInsertImagesStmt, params, pSizes, pformats);
 	if (!res.commandOK()) {
-		LOG(WARNING) << "insert image error:" << res.errorMessage();
-		throw FormattedException("failed to insert image in db: %s", res.errorMessage());
+		imageIds.clear();
+		throw FormattedException("failed to insert images in db: %s", res.errorMessage());
+	}
+	for (auto &image : images)
+		fs::remove(image.first);
+}
+
+//images are uploaded together by flushImages()
+void
+RC2::FileManager::Impl::queueImage(string fname)
+{
+	imageQueue_.push_back(make_pair(workingDir + "/" + fname, imageUploadSeq_++));
+	if (imageQueue_.size() >= kImageBatchSize)
+		flushImages();
+}
+
+//sessions that never plot don't need the connections
+void
+RC2::FileManager::Impl::startImageUploaders()
+{
+	string connectString;
+	connectString.swap(imageConnectString_); //only tried once
+	try {
+		for (int i=0; i < kImageUploadWorkers; i++) {
+			auto imageConnection = make_shared<PGDBConnection>();
+			imageConnection->connect(connectString);
+			unique_ptr<ImageUploader> uploader(new ImageUploader());
+			uploader->worker.reset(new IOWorker(eventBase_, imageConnection));
+			imageUploaders_.push_back(std::move(uploader));
+		}
+	} catch (exception &e) {
+		LOG(WARNING) << "image uploads will block, failed to start upload threads: " << e.what();
+	}
+}
+
+//splits the queued images into batches spread across the uploaders
+void
+RC2::FileManager::Impl::flushImages()
+{
+	if (imageQueue_.empty())
+		return;
+	if (!imageConnectString_.empty())
+		startImageUploaders();
+	if (sessionImageBatch_ <= 0) {
+		const string sessionStr = to_string(sessionRecId_);
+		const char *params[] = {sessionStr.c_str()};
+		sessionImageBatch_ = dbConnection_->longFromPrepared(kNextImageBatchStmt, params);
+	}
+	long sessionId = sessionRecId_, batchId = sessionImageBatch_;
+	vector<pair<string, long>> queue; //failed uploads can be queued again while sending these
+	queue.swap(imageQueue_);
+	for (size_t start=0; start < queue.size(); start += kImageBatchSize) {
+		auto first = queue.begin() + start;
+		auto images = make_shared<vector<pair<string, long>>>(first, 
+			first + min(kImageBatchSize, queue.size() - start));
+		auto inserted = make_shared<vector<long>>();
+		auto failed = make_shared<bool>(false);
+		//completions aren't called when a job throws, so failures are caught in the job
+		auto upload = [sessionId, batchId, images, inserted, failed](PGDBConnection &con, 
+			SequenceAllocator &ids) 
+		{
+			try {
+				insertImages(con, ids, sessionId, batchId, *images, *inserted);
+			} catch (exception &e) {
+				LOG(WARNING) << "image upload failed: " << e.what();
+				*failed = true;
+			}
+		};
+		IOWorker::Completion completion = [this, images, inserted, failed]() {
+			if (*failed) {
+				requeueImages(*images);
+				return;
+			}
+			for (size_t i=0; i < images->size(); i++) {
+				const pair<string, long> &image = images->at(i);
+				if (inserted->at(i) > 0)
+					uploadedImages_[image.second] = inserted->at(i);
+				retriedImages_.erase(image.first);
+			}
+		};
+		if (imageUploaders_.empty()) {
+			upload(*dbConnection_, imageIdAllocator_);
+			completion();
+			continue;
+		}
+		ImageUploader &uploader = *imageUploaders_[nextImageUploader_++ % imageUploaders_.size()];
+		SequenceAllocator *ids = &uploader.ids;
+		uploader.worker->post([upload, ids](PGDBConnection &con) { upload(con, *ids); }, completion);
+	}
+}
+
+//a failed upload is tried once more with the next flush, keeping its place in the plot
+// order. After that its files are left in place
+void
+RC2::FileManager::Impl::requeueImages(const vector<pair<string, long>> &images)
+{
+	for (auto &image : images) {
+		const string &path = image.first;
+		if (retriedImages_.erase(path) > 0) {
+			LOG(WARNING) << "giving up uploading image " << path;
+			continue;
+		}
+		LOG(WARNING) << "will retry uploading image " << path;
+		retriedImages_.insert(path);
+		imageQueue_.push_back(image);
+	}
+}
+
+//only waits on image uploads, not file changes or checkpoints on the io worker
+void
+RC2::FileManager::Impl::waitForImages()
+{
+	//the second pass sends any failed uploads that were queued again
+	for (int pass=0; pass < 2; pass++) {
+		flushImages();
+		for (auto &uploader : imageUploaders_)
+			uploader->worker->drain();
 	}
-//	LOG(INFO) << "inserted image " << imgId << " of size " << size;
-	imageIds_.push_back(imgId);
-	ignoreFSNotifications();
-	fs::remove(filePath);
-	return 0;
+	for (auto &entry : uploadedImages_)
+		imageIds_.push_back(entry.second);
+	uploadedImages_.clear();
 }
 
 void RC2::FileManager::Impl::startImageWatch ( string fname, string imgNum, inotify_event* event )
@@ -207,19 +426,22 @@ void RC2::FileManager::Impl::cleanupImageWatch()
 		imgPath /= it->second.fileName;
 		auto size = fs::file_size(imgPath);
 		if (size !=  static_cast<uintmax_t>(-1)) {
-			insertImage(it->second.fileName, it->second.imgNumStr);
+			queueImage(it->second.fileName);
 			//have to manually stopImageWatch so itr isn't mutated while looping
 			inotify_rm_watch(inotifyFd_, it->second.wd);
 		}
 	}
 	//clear set
 	pendingImagesByWatchDesc_.erase(pendingImagesByWatchDesc_.begin(), pendingImagesByWatchDesc_.end());
+	flushImages();
 }
 
 
 void
 RC2::FileManager::Impl::processDBNotification(string message)
 {
+	//a prefetch in flight must finish before the file's rows are loaded again
+	dbConnection_->finishAsync();
 	LOG(INFO) << "db notification: " << message;
 	char type = message.c_str()[0];
 	if (!(type == 'i' || type == 'u' || type == 'd') || message.length() < 2) {
@@ -242,8 +464,10 @@ RC2::FileManager::Impl::processDBNotification(string message)
 		if (type == 'd') {
 			try {
 				DBFileInfoPtr fobj = dbFileSource_->filesById_.at(fileId);
+				pendingChanges_.erase(fobj->name);
 				//stop notify watch first
-				inotify_rm_watch(inotifyFd_, fobj->watchDescriptor);
+				if (fobj->watchDescriptor != -1)
+					inotify_rm_watch(inotifyFd_, fobj->watchDescriptor);
 				dbFileSource_->filesById_.erase(fileId);
 				filesByWatchDesc_.erase(fileId);
 				fs::remove(workingDir + "/" + fobj->path);
@@ -262,13 +486,17 @@ RC2::FileManager::Impl::processDBNotification(string message)
 			if (type == 'i') {
 				LOG(INFO) << "got insert for " << fileId;
 				ignoreFSNotifications();
-				dbFileSource_->loadFiles(query.str().c_str());
+				dbFileSource_->loadFile(fileId);
 				watchFile(dbFileSource_->filesById_[fileId]);
 			} else if (type == 'u') {
 				LOG(INFO) << "got update for " << fileId;
 				if (dbFileSource_->filesById_.count(fileId) > 0) {
-					ignoreFSNotifications();
-					dbFileSource_->loadFiles(query.str().c_str());
+					if (dbFileSource_->filesById_[fileId]->materialized) {
+						ignoreFSNotifications();
+						dbFileSource_->loadFile(fileId);
+					} else {
+						dbFileSource_->loadFileMetadata(query.str().c_str());
+					}
 				}
 			}
 		}
@@ -281,12 +509,16 @@ void
 RC2::FileManager::Impl::handleDBNotifications()
 {
 	LOG(INFO) << "handleDBNotifications called";
-	ignoreFSNotifications();
-	PGnotify *notify;
+	//async query results arrive on the same socket, so this is often called without one
+	bool ignoring = false;
 	dbConnection_->consumeInput();
 	string name, channel;
 	while (dbConnection_->checkForNotification(name, channel)) {
 		LOG(INFO) << "got notification " << channel;
+		if (!ignoring) {
+			ignoreFSNotifications();
+			ignoring = true;
+		}
 		if (!ignoreDBNotifications_)
 			processDBNotification(channel);
 	}
@@ -330,14 +562,293 @@ RC2::FileManager::Impl::ignoreFSNotifications()
 
 bool
 RC2::FileManager::Impl::fileExistsWithName(string fname) {
+	return fileWithName(fname) != nullptr;
+}
+
+RC2::DBFileInfoPtr
+RC2::FileManager::Impl::fileWithName(string fname) {
 	auto & fileMap = dbFileSource_->filesById_;
 	for (auto itr = fileMap.begin(); itr != fileMap.end(); ++itr) {
 		DBFileInfoPtr ptr = itr->second;
 		if (0 == fname.compare(ptr->name)) {
-			return true;
+			return ptr;
+		}
+	}
+	return nullptr;
+}
+
+//does not ignore fs notifications: this can be called right before R executes, and
+// the notifications R causes must not be skipped
+bool
+RC2::FileManager::Impl::materialize(DBFileInfoPtr file)
+{
+	if (file->materialized)
+		return true;
+	if (fs::exists(workingDir + "/" + file->path)) {
+		//R created it before we fetched it
+		adoptLocalFile(file);
+		return true;
+	}
+	LOG(INFO) << "materializing " << file->name;
+	if (!dbFileSource_->materializeFile(file)) {
+		LOG(WARNING) << "failed to materialize " << file->name;
+		return false;
+	}
+	try {
+		watchFile(file);
+	} catch (StatException &se) {
+		LOG(WARNING) << se.what();
+	}
+	return true;
+}
+
+//a local file was written with the name of a file that was never materialized. It
+// replaces the database version.
+void
+RC2::FileManager::Impl::adoptLocalFile(DBFileInfoPtr file)
+{
+	LOG(INFO) << "local file replaces unmaterialized " << file->name;
+	file->materialized = true;
+	watchFile(file);
+	queueChange(file->name, PendingChangeType::Update, file->id);
+}
+
+//merges the change with any pending change to the same file, so a create followed by
+// writes is a single insert, a create then delete is nothing, and a delete then create
+// is an update
+void
+RC2::FileManager::Impl::queueChange(string fname, PendingChangeType type, long fileId)
+{
+	auto existing = pendingChanges_.find(fname);
+	if (existing == pendingChanges_.end()) {
+		pendingChanges_[fname] = PendingChange{type, fileId};
+	} else {
+		PendingChange &change = existing->second;
+		switch (type) {
+			case PendingChangeType::Insert:
+				if (change.type == PendingChangeType::Remove)
+					change.type = PendingChangeType::Update;
+				break;
+			case PendingChangeType::Update:
+				break; //an insert or update will send the latest contents
+			case PendingChangeType::Remove:
+				if (change.type == PendingChangeType::Insert)
+					pendingChanges_.erase(existing);
+				else
+					change.type = PendingChangeType::Remove;
+				break;
+		}
+	}
+	scheduleSync();
+}
+
+void
+RC2::FileManager::Impl::scheduleSync()
+{
+	if (eventBase_ == nullptr)
+		return;
+	if (syncEvent_ == nullptr)
+		syncEvent_ = event_new(eventBase_, -1, 0, Impl::handleSyncEvent, this);
+	if (!event_pending(syncEvent_, EV_TIMEOUT, NULL))
+		event_add(syncEvent_, &kSyncDelay);
+}
+
+//without a worker, jobs run immediately on the main connection
+void
+RC2::FileManager::Impl::runIO(IOWorker::Job job, IOWorker::Completion completion)
+{
+	if (ioWorker_) {
+		ioWorker_->post(job, completion);
+		return;
+	}
+	try {
+		job(*dbConnection_);
+	} catch (exception &e) {
+		LOG(WARNING) << "io job failed: " << e.what();
+		return;
+	}
+	if (completion)
+		completion();
+}
+
+//jobs use the worker's connection, so this must be called before the main thread does
+void
+RC2::FileManager::Impl::waitForIO()
+{
+	if (ioWorker_)
+		ioWorker_->drain();
+}
+
+//failed changes are older than anything queued since, so they go first and newer
+// changes are merged on top of them
+void
+RC2::FileManager::Impl::requeueChanges(const map<string, PendingChange> &failed)
+{
+	map<string, PendingChange> newer;
+	newer.swap(pendingChanges_);
+	pendingChanges_ = failed;
+	for (auto &entry : newer)
+		queueChange(entry.first, entry.second.type, entry.second.fileId);
+	scheduleSync();
+}
+
+//sends all pending changes in one transaction on the io worker. Each change has a 
+// savepoint so one failure doesn't lose the rest. The worker only gets copies of the
+// files, and their changes are applied to filesById_ here once the batch commits
+void
+RC2::FileManager::Impl::syncPendingChanges()
+{
+	if (syncEvent_ != nullptr)
+		event_del(syncEvent_);
+	if (pendingChanges_.empty())
+		return;
+	if (syncInFlight_) {
+		scheduleSync(); //copies would miss the versions the last sync is still sending
+		return;
+	}
+	auto changes = make_shared<map<string, PendingChange>>();
+	changes->swap(pendingChanges_);
+	LOG(INFO) << "syncing " << changes->size() << " file changes";
+	auto & fileMap = dbFileSource_->filesById_;
+	auto files = make_shared<map<long, DBFileInfoPtr>>();
+	for (auto &entry : *changes) {
+		PendingChange &change = entry.second;
+		if (change.type == PendingChangeType::Insert || fileMap.count(change.fileId) == 0)
+			continue;
+		DBFileInfoPtr fobj = fileMap[change.fileId];
+		if (change.type == PendingChangeType::Update && fobj->watchDescriptor == -1)
+			watchFile(fobj); //recreated after being deleted
+		(*files)[change.fileId] = make_shared<DBFileInfo>(*fobj);
+	}
+	shared_ptr<DBFileSource> fileSource = dbFileSource_;
+	string dir = workingDir;
+	auto newFileIds = make_shared<vector<long>>();
+	auto updates = make_shared<vector<function<void()>>>();
+	auto failed = make_shared<bool>(false);
+	auto failedNames = make_shared<set<string>>();
+	syncInFlight_ = true;
+	runIO([fileSource, dir, changes, files, newFileIds, updates, failed, failedNames](PGDBConnection &con) {
+		try {
+			fileSource->beginBatch();
+			for (auto &entry : *changes) {
+				const string &fname = entry.first;
+				PendingChange &change = entry.second;
+				con.executeQuery("savepoint filechange");
+				try {
+					if (change.type == PendingChangeType::Insert) {
+						if (fs::exists(dir + "/" + fname))
+							newFileIds->push_back(fileSource->insertDBFile(fname));
+					} else if (files->count(change.fileId) > 0) {
+						DBFileInfoPtr fobj = files->at(change.fileId);
+						if (change.type == PendingChangeType::Remove)
+							fileSource->removeDBFile(fobj);
+						else
+							fileSource->updateDBFile(fobj);
+					}
+					con.executeQuery("release savepoint filechange");
+				} catch (exception &e) {
+					LOG(WARNING) << "failed to sync " << fname << ": " << e.what();
+					con.executeQuery("rollback to savepoint filechange");
+					failedNames->insert(fname);
+				}
+			}
+			*updates = fileSource->commitBatch();
+		} catch (exception &e) {
+			LOG(WARNING) << "failed to sync file changes: " << e.what();
+			fileSource->rollbackBatch();
+			newFileIds->clear();
+			*failed = true;
+		}
+	}, [this, changes, newFileIds, updates, failed, failedNames]() {
+		syncInFlight_ = false;
+		for (auto &update : *updates)
+			update();
+		if (*failed) {
+			//nothing was saved, so send them all again
+			requeueChanges(*changes);
+			return;
+		}
+		map<string, PendingChange> retry;
+		for (auto &entry : *changes) {
+			const string &fname = entry.first;
+			if (failedNames->count(fname) == 0) {
+				syncFailures_.erase(fname);
+			} else if (++syncFailures_[fname] < kMaxSyncAttempts) {
+				retry[fname] = entry.second;
+			} else {
+				LOG(WARNING) << "giving up on syncing " << fname;
+				syncFailures_.erase(fname);
+			}
+		}
+		if (!retry.empty())
+			requeueChanges(retry);
+		auto & fileMap = dbFileSource_->filesById_;
+		for (long fileId : *newFileIds) {
+			if (fileMap.count(fileId) > 0)
+				watchFile(fileMap[fileId]);
+		}
+	});
+}
+
+void
+RC2::FileManager::Impl::schedulePrefetch()
+{
+	if (eventBase_ == nullptr)
+		return;
+	if (prefetchEvent_ == nullptr) {
+		prefetchEvent_ = event_new(eventBase_, -1, 0, Impl::handlePrefetch, this);
+		event_priority_set(prefetchEvent_, 3); //only when nothing else is pending
+	}
+	struct timeval immediately = {0, 0};
+	event_add(prefetchEvent_, &immediately);
+}
+
+//fetches one file at a time without blocking, so the event loop keeps serving the client
+// while the contents are in flight
+void
+RC2::FileManager::Impl::prefetchNextFile()
+{
+	if (dbConnection_->asyncPending())
+		return; //the pending fetch schedules the next one
+	auto & fileMap = dbFileSource_->filesById_;
+	auto next = find_if(fileMap.begin(), fileMap.end(), [this](const pair<const long, DBFileInfoPtr> &entry) {
+		return !entry.second->materialized && prefetchFailures_.count(entry.first) == 0;
+	});
+	if (next == fileMap.end())
+		return;
+	DBFileInfoPtr file = next->second;
+	try {
+		if (fs::exists(workingDir + "/" + file->path)) {
+			adoptLocalFile(file); //R created it first
+			schedulePrefetch();
+		} else if (dbFileSource_->fetchFileContents(file, [this, file](DBResult &res) { prefetchFetched(file, res); })) {
+			watchFile(file); //was in the file cache
+			schedulePrefetch();
+		}
+	} catch (exception &e) {
+		LOG(WARNING) << "prefetch of " << file->name << " failed: " << e.what();
+		prefetchFailures_.insert(file->id);
+		schedulePrefetch();
+	}
+}
+
+void
+RC2::FileManager::Impl::prefetchFetched(DBFileInfoPtr file, DBResult &res)
+{
+	bool loaded = false;
+	try {
+		if (file->materialized || dbFileSource_->filesById_.count(file->id) == 0) {
+			loaded = true; //created by R or deleted while in flight
+		} else if (dbFileSource_->storeFileContents(file, res)) {
+			loaded = true;
+			watchFile(file);
 		}
+	} catch (exception &e) {
+		LOG(WARNING) << "prefetch of " << file->name << " failed: " << e.what();
 	}
-	return false;
+	if (!loaded) //don't retry it forever. It will still load on demand
+		prefetchFailures_.insert(file->id);
+	schedulePrefetch();
 }
 
 #pragma mark -
@@ -353,6 +864,8 @@ RC2::FileManager::Impl::setupInotify(FileManager *fm) {
 		throw FormattedException("inotify_add_watched failed");
 	stat(workingDir.c_str(), &rootDir_.sb);
 	for (auto itr=dbFileSource_->filesById_.begin(); itr != dbFileSource_->filesById_.end(); ++itr) {
+		if (!itr->second->materialized)
+			continue;
 		try {
 			watchFile(itr->second);
 		} catch (Impl::StatException &se) {
@@ -366,67 +879,66 @@ RC2::FileManager::Impl::setupInotify(FileManager *fm) {
 	inotifyEvent_ = evt;
 }
 
-#define I_BUF_LEN (10 * (sizeof(struct inotify_event) + NAME_MAX + 1))
-
+//only records what changed. The database is updated by syncPendingChanges()
 void
 RC2::FileManager::Impl::handleInotifyEvent(struct bufferevent *bev)
 {
-	bool ignoring = ignoreFSNotifications_;
-	if (!ignoring)
-		ignoreFSNotifications();
-	char buf[I_BUF_LEN];
-	size_t numRead = bufferevent_read(bev, buf, I_BUF_LEN);
-	char *p;
-	if (ignoring) {
+	//the input buffer only ever holds whole events, so process all of them at once
+	struct evbuffer *input = bufferevent_get_input(bev);
+	size_t numRead = evbuffer_get_length(input);
+	char *buf = reinterpret_cast<char*>(evbuffer_pullup(input, numRead));
+	Defer drainInput([input, numRead]() { evbuffer_drain(input, numRead); });
+	if (ignoreFSNotifications_) {
 		LOG(INFO) << "ignoring " << numRead << "inotify events";
 		return;
 	}
-	for (p=buf; p < buf + numRead; ) {
+	for (char *p=buf; p < buf + numRead; ) {
 		struct inotify_event *event = (struct inotify_event*)p;
 		int evtype = event->mask & 0xffff; //events are in lower word, flags in upper
 		LOG(INFO) << "notify:" << std::hex << event->mask;
 		try {
 			if(evtype == IN_CREATE) {
 				if (!(event->mask & IN_ISDIR)) { //we don't want these events, they are duplicates
-					long newFileId=0;
 					string fname = event->name;
 					boost::smatch what;
 					if (event->name[0] != '.') {
 						if (boost::regex_match(fname, what, imgRegex_, boost::match_default)) {
 							startImageWatch(fname, what[1], event);
-//							newFileId = insertImage(fname, what[1]);
 						} else if (manuallyAddedFiles_.find(fname) == manuallyAddedFiles_.end()) {
-							if (fileExistsWithName(fname)) {
+							DBFileInfoPtr existing = fileWithName(fname);
+							if (existing && !existing->materialized) {
+								adoptLocalFile(existing);
+							} else if (existing && existing->watchDescriptor == -1) {
+								LOG(INFO) << "create for deleted file " << fname;
+								queueChange(fname, PendingChangeType::Insert, existing->id);
+							} else if (existing) {
 								LOG(INFO) << "create for existing file " << fname;
 							} else {
 								LOG(INFO) << "inotify create for " << fname << ": " << manuallyAddedFiles_.size();
-								newFileId = dbFileSource_->insertDBFile(fname);
-								LOG(INFO) << "inserted s " << newFileId;
+								queueChange(fname, PendingChangeType::Insert, 0);
 							}
 						}
-						if (newFileId > 0) {
-							//need to add a watch for this file
-							watchFile(dbFileSource_->filesById_[newFileId]);
-						}
 					}
 				}
 			} else if (evtype == IN_CLOSE_WRITE) {
 				auto imgItr = pendingImagesByWatchDesc_.find(event->wd);
 				if (imgItr != pendingImagesByWatchDesc_.end()) {
-					insertImage(imgItr->second.fileName, imgItr->second.imgNumStr);
+					queueImage(imgItr->second.fileName);
 					stopImageWatch(event->wd);
-				} else {
+				} else if (filesByWatchDesc_.count(event->wd) > 0) {
 					DBFileInfoPtr fobj = filesByWatchDesc_[event->wd];
 					LOG(INFO) << "got close write event for " << fobj->name;
-					dbFileSource_->updateDBFile(fobj);
+					queueChange(fobj->name, PendingChangeType::Update, fobj->id);
 				}
 			} else if (evtype == IN_DELETE_SELF) {
-
-				DBFileInfoPtr fobj = filesByWatchDesc_[event->wd];
-			LOG(INFO) << "got delete event for " << fobj->name;
-				dbFileSource_->removeDBFile(fobj);
-				filesByWatchDesc_.erase(fobj->id);
-				//discard our records of it
+				if (filesByWatchDesc_.count(event->wd) > 0) {
+					DBFileInfoPtr fobj = filesByWatchDesc_[event->wd];
+					LOG(INFO) << "got delete event for " << fobj->name;
+					queueChange(fobj->name, PendingChangeType::Remove, fobj->id);
+					//discard our records of it
+					filesByWatchDesc_.erase(event->wd);
+					fobj->watchDescriptor = -1;
+				}
 				inotify_rm_watch(inotifyFd_, event->wd);
 			} else if (evtype == IN_OPEN) {
 				DBFileInfoPtr fobj = filesByWatchDesc_[event->wd];
@@ -441,6 +953,7 @@ RC2::FileManager::Impl::handleInotifyEvent(struct bufferevent *bev)
 		//handle event
 		p += sizeof(struct inotify_event) + event->len;
 	}
+	flushImages(); //so images from one read share a batch
 }
 
 void 
@@ -463,6 +976,8 @@ RC2::FileManager::FileManager()
 	: _impl(new Impl())
 {
 	_impl->eventBase_ = nullptr;
+	_impl->prefetchEvent_ = nullptr;
+	_impl->syncEvent_ = nullptr;
 	_impl->inotifyFd_ = -1;
 }
 
@@ -487,6 +1002,26 @@ RC2::FileManager::initFileManager(std::string workingDir, std::shared_ptr<PGDBCo
 		EV_READ|EV_PERSIST, RC2::FileManager::Impl::handleDBNotify, this);
 	event_priority_set(evt, 2); //so inotify events handled first
 	event_add(evt, NULL);
+	_impl->schedulePrefetch();
+}
+
+void
+RC2::FileManager::startIOThread(string connectString)
+{
+	auto connection = make_shared<PGDBConnection>();
+	connection->connect(connectString);
+	_impl->waitForIO();
+	_impl->ioWorker_.reset(new IOWorker(_impl->eventBase_, connection));
+	_impl->dbFileSource_->setWriteConnection(_impl->ioWorker_->connection());
+	_impl->waitForImages();
+	_impl->imageConnectString_ = connectString;
+}
+
+void
+RC2::FileManager::setFileCacheDir(std::string dir, uint64_t maxBytes)
+{
+	_impl->fileCacheDir_ = dir;
+	_impl->fileCacheMaxBytes_ = maxBytes;
 }
 
 void RC2::FileManager::suspendNotifyEvents()
@@ -525,6 +1060,7 @@ void
 RC2::FileManager::resetWatch()
 {
 //	LOG(INFO) << "fm:resetWatch called: " << _impl->imageIds_.size();
+	_impl->waitForImages();
 	if (_impl->imageIds_.size() > 0) {
 		_impl->sessionImageBatch_++;
 		LOG(INFO) << "incrementing batch_id:" << _impl->sessionImageBatch_;
@@ -536,6 +1072,7 @@ RC2::FileManager::resetWatch()
 void
 RC2::FileManager::checkWatch(vector<long> &imageIds, long &batchId)
 {
+	_impl->waitForImages();
 	imageIds = _impl->imageIds_;
 	batchId = _impl->sessionImageBatch_;
 //	_impl->sessionImageBatch_ = 0;
@@ -549,31 +1086,111 @@ void RC2::FileManager::cleanupImageWatch()
 bool
 RC2::FileManager::loadRData()
 {
+	_impl->waitForIO();
 	return _impl->dbFileSource_->loadRData();
 }
 
 void
 RC2::FileManager::saveRData()
 {
+	_impl->waitForIO();
 	_impl->dbFileSource_->saveRData();
 }
 
+void
+RC2::FileManager::setWorkspaceCodec(BlobCodec codec)
+{
+	_impl->waitForIO();
+	_impl->dbFileSource_->setCodec(codec);
+}
+
+bool
+RC2::FileManager::compressesRData()
+{
+	_impl->waitForIO();
+	return _impl->dbFileSource_->compressesRData();
+}
+
+bool
+RC2::FileManager::checkpointAvailable()
+{
+	_impl->waitForIO();
+	return _impl->dbFileSource_->checkpointAvailable();
+}
+
+//errors are only thrown when waiting. In the background they are logged
+void
+RC2::FileManager::saveCheckpoint(vector<CheckpointVariable> changed, vector<string> removed, 
+	bool replace, bool wait, function<void ()> saved)
+{
+	if (wait) {
+		_impl->waitForIO();
+		_impl->dbFileSource_->saveCheckpoint(*_impl->dbConnection_, changed, removed, replace);
+		if (saved)
+			saved();
+		return;
+	}
+	auto changedPtr = make_shared<vector<CheckpointVariable>>(std::move(changed));
+	auto removedPtr = make_shared<vector<string>>(std::move(removed));
+	shared_ptr<DBFileSource> fileSource = _impl->dbFileSource_;
+	_impl->runIO([fileSource, changedPtr, removedPtr, replace](PGDBConnection &con) {
+		fileSource->saveCheckpoint(con, *changedPtr, *removedPtr, replace);
+	}, saved);
+}
+
+bool
+RC2::FileManager::loadCheckpoint(function<void (const CheckpointVariable&)> handler)
+{
+	_impl->waitForIO();
+	return _impl->dbFileSource_->loadCheckpoint(handler);
+}
+
 void
 RC2::FileManager::findOrAddFile(std::string fname, FileInfo &info)
 {
 	auto & fileMap = _impl->dbFileSource_->filesById_;
-	for (auto itr = fileMap.begin(); itr != fileMap.end(); ++itr) {
-		DBFileInfoPtr ptr = itr->second;
-		if (0 == fname.compare(ptr->name)) {
-			//a match. 
-			_impl->fileInfoForDBPtr(ptr, info);
-			return;
+	auto findFile = [&]() {
+		for (auto itr = fileMap.begin(); itr != fileMap.end(); ++itr) {
+			DBFileInfoPtr ptr = itr->second;
+			if (0 == fname.compare(ptr->name)) {
+				//a match. 
+				_impl->fileInfoForDBPtr(ptr, info);
+				return true;
+			}
 		}
-	}
-	//need to add the file
-	long fid = _impl->dbFileSource_->insertDBFile(fname);
+		return false;
+	};
+	if (findFile())
+		return;
+	//a sync in flight might be adding it, and the insert needs the worker's connection
+	_impl->waitForIO();
+	if (findFile())
+		return;
+	//need to add the file. It is sent now, so a pending insert would add it twice
+	auto pending = _impl->pendingChanges_.find(fname);
+	if (pending != _impl->pendingChanges_.end() && pending->second.type == PendingChangeType::Insert)
+		_impl->pendingChanges_.erase(pending);
+	shared_ptr<DBFileSource> fileSource = _impl->dbFileSource_;
+	auto updates = make_shared<vector<function<void()>>>();
+	auto fid = make_shared<long>(0);
+	_impl->runIO([fileSource, fname, updates, fid](PGDBConnection &con) {
+		fileSource->beginBatch();
+		try {
+			*fid = fileSource->insertDBFile(fname);
+			*updates = fileSource->commitBatch();
+		} catch (...) {
+			fileSource->rollbackBatch();
+			throw;
+		}
+	}, [updates]() {
+		for (auto &update : *updates)
+			update();
+	});
+	_impl->waitForIO();
+	if (fileMap.count(*fid) == 0)
+		throw FormattedException("failed to add file %s", fname.c_str());
 	_impl->manuallyAddedFiles_.insert(fname);
-	_impl->fileInfoForDBPtr(_impl->dbFileSource_->filesById_[fid], info);
+	_impl->fileInfoForDBPtr(fileMap[*fid], info);
 }
 
 bool 
@@ -598,10 +1215,37 @@ RC2::FileManager::filePathForId(long fileId, string& filePath)
 		LOG(WARNING) << "filenameForId called with invalid id: " << fileId;
 		return false;
 	}
+	if (!_impl->materialize(fileCache[fileId]))
+		return false;
 	filePath = fileCache[fileId]->path;
 	return true;
 }
 
+void
+RC2::FileManager::prefetchReferencedFiles(const std::string &code)
+{
+	if (!_impl->dbFileSource_)
+		return;
+	for (auto &entry : _impl->dbFileSource_->filesById_) {
+		DBFileInfoPtr file = entry.second;
+		if (file->materialized || code.find(file->name) == string::npos)
+			continue;
+		try {
+			_impl->materialize(file);
+		} catch (exception &e) {
+			LOG(WARNING) << "failed to prefetch " << file->name << ": " << e.what();
+		}
+	}
+}
+
+void
+RC2::FileManager::flushPendingChanges()
+{
+	_impl->waitForIO(); //so a sync in flight doesn't delay this one
+	_impl->syncPendingChanges();
+	_impl->waitForIO();
+}
+
 void
 RC2::FileManager::processDBNotification(string message)
 {
@@ -1,10 +1,12 @@
 #pragma once
 
 #include <memory>
+#include <cstdint>
 #include <vector>
 #include <functional>
 #include <event2/event.h>
 #include "common/PGDBConnection.hpp"
+#include "BlobCodec.hpp"
 
 namespace RC2 {
 	
@@ -35,6 +37,13 @@ namespace RC2 {
 		}
 	};
 	
+	//a serialized variable in a workspace checkpoint. hash is of data
+	struct CheckpointVariable {
+		std::string name;
+		uint64_t hash;
+		std::string data;
+	};
+	
 	class DBFileSource;
 	
 	class FileManager {
@@ -49,6 +58,12 @@ namespace RC2 {
 		virtual std::string	getWorkingDir() const; //necessary for subclass to get variable stored in impl class
 //		virtual void 	setWorkingDir(std::string dir);
 		virtual void	setEventBase(struct event_base *evbase);
+		//moves file uploads to a background thread and image uploads to a small pool of
+		// them, each with its own connection. The pool connects when the first image is
+		// uploaded. Call after initFileManager()
+		virtual void	startIOThread(std::string connectString);
+		//a node wide cache of file contents. Must be set before initFileManager(); empty disables it
+		virtual void	setFileCacheDir(std::string dir, uint64_t maxBytes);
 		
 		virtual void	resetWatch();
 		virtual void	checkWatch(std::vector<long> &imageIds, long &batchId);
@@ -56,11 +71,31 @@ namespace RC2 {
 		
 		virtual bool	loadRData();
 		virtual void	saveRData();
+		//how .RData and checkpoints are compressed. Call after initFileManager()
+		virtual void	setWorkspaceCodec(BlobCodec codec);
+		//true if saveRData() compresses .RData itself
+		virtual bool	compressesRData();
 		
+		//false if the database has no table for checkpoints
+		virtual bool	checkpointAvailable();
+		//stores changed variables and forgets removed ones, after discarding the whole stored
+		// checkpoint if replace is true. Runs in the background unless wait is true. saved is
+		// called once it is stored
+		virtual void	saveCheckpoint(std::vector<CheckpointVariable> changed, std::vector<std::string> removed,
+									   bool replace, bool wait, std::function<void ()> saved);
+		//calls handler with each variable of the last checkpoint. Returns false if there isn't one
+		virtual bool	loadCheckpoint(std::function<void (const CheckpointVariable&)> handler);
+		
+		//file contents are fetched when first needed, so this can block on the database
 		virtual bool	filePathForId(long fileId, std::string& filePath);
+		//fetches any files whose names appear in code so R can read them
+		virtual void	prefetchReferencedFiles(const std::string &code);
 		virtual void	findOrAddFile(std::string fname, FileInfo &info);
 		virtual bool	fileInfoForId(long fileId, FileInfo &info);
 		
+		//file changes are sent to the database in batches after a short delay. This sends them now
+		virtual void	flushPendingChanges();
+		
 		virtual void	suspendNotifyEvents();
 		virtual void	resumeNotifyEvents();
 		
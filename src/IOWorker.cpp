@@ -0,0 +1,158 @@
+#include "IOWorker.hpp"
+#include <thread>
+#include <atomic>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <boost/lockfree/spsc_queue.hpp>
+#include "common/FormattedException.hpp"
+#include "RC2Logging.h"
+
+using namespace std;
+
+struct IOTask {
+	RC2::IOWorker::Job job;
+	RC2::IOWorker::Completion completion;
+	string error;
+};
+
+//more than this many outstanding jobs makes post() wait for the worker
+const size_t kQueueCapacity = 1024;
+
+typedef boost::lockfree::spsc_queue<IOTask*, boost::lockfree::capacity<kQueueCapacity>> TaskQueue;
+
+class RC2::IOWorker::Impl {
+public:
+	shared_ptr<PGDBConnection>	connection_;
+	TaskQueue			jobs_; //main thread to worker
+	TaskQueue			finished_; //worker to main thread
+	int					jobsFd_, finishedFd_;
+	struct event*		finishedEvent_;
+	atomic<long>		outstanding_;
+	thread				thread_;
+
+	Impl() : jobsFd_(-1), finishedFd_(-1), finishedEvent_(nullptr), outstanding_(0) {}
+
+	void	run();
+	void	runCompletions();
+	static void	signal(int fd);
+	static void handleFinished(int fd, short event_type, void *ctx)
+	{
+		reinterpret_cast<Impl*>(ctx)->runCompletions();
+	}
+};
+
+void
+RC2::IOWorker::Impl::signal(int fd)
+{
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) != sizeof(one))
+		LOG(WARNING) << "failed to signal io worker: " << errno;
+}
+
+//a null task tells the thread to exit
+void
+RC2::IOWorker::Impl::run()
+{
+	uint64_t count;
+	while (true) {
+		if (read(jobsFd_, &count, sizeof(count)) < 0 && errno != EINTR)
+			return;
+		IOTask *task;
+		while (jobs_.pop(task)) {
+			if (task == nullptr)
+				return;
+			try {
+				task->job(*connection_);
+			} catch (exception &e) {
+				task->error = e.what();
+			}
+			while (!finished_.push(task))
+				this_thread::yield();
+			signal(finishedFd_);
+		}
+	}
+}
+
+void
+RC2::IOWorker::Impl::runCompletions()
+{
+	uint64_t count;
+	if (read(finishedFd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		LOG(WARNING) << "io worker read failed: " << errno;
+	IOTask *task;
+	while (finished_.pop(task)) {
+		unique_ptr<IOTask> taskPtr(task);
+		if (!task->error.empty()) {
+			LOG(WARNING) << "io job failed: " << task->error;
+		} else if (task->completion) {
+			try {
+				task->completion();
+			} catch (exception &e) {
+				LOG(WARNING) << "io completion failed: " << e.what();
+			}
+		}
+		--outstanding_;
+	}
+}
+
+RC2::IOWorker::IOWorker(struct event_base *eventBase, shared_ptr<PGDBConnection> connection)
+	: _impl(new Impl())
+{
+	_impl->connection_ = connection;
+	_impl->jobsFd_ = eventfd(0, EFD_CLOEXEC);
+	_impl->finishedFd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (_impl->jobsFd_ == -1 || _impl->finishedFd_ == -1)
+		throw FormattedException("failed to create io worker eventfd: %d", errno);
+	_impl->finishedEvent_ = event_new(eventBase, _impl->finishedFd_, EV_READ|EV_PERSIST,
+		Impl::handleFinished, _impl.get());
+	event_priority_set(_impl->finishedEvent_, 1);
+	event_add(_impl->finishedEvent_, NULL);
+	_impl->thread_ = thread([this]() { _impl->run(); });
+}
+
+RC2::IOWorker::~IOWorker()
+{
+	drain();
+	while (!_impl->jobs_.push(nullptr))
+		this_thread::yield();
+	Impl::signal(_impl->jobsFd_);
+	_impl->thread_.join();
+	event_free(_impl->finishedEvent_);
+	close(_impl->jobsFd_);
+	close(_impl->finishedFd_);
+}
+
+void
+RC2::IOWorker::post(Job job, Completion completion)
+{
+	IOTask *task = new IOTask{job, completion, ""};
+	++_impl->outstanding_;
+	while (!_impl->jobs_.push(task))
+		this_thread::yield();
+	Impl::signal(_impl->jobsFd_);
+}
+
+void
+RC2::IOWorker::drain()
+{
+	//completions can post more jobs, so check after each batch
+	while (_impl->outstanding_ > 0) {
+		struct pollfd pfd = {_impl->finishedFd_, POLLIN, 0};
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			throw FormattedException("poll failed waiting on io worker: %d", errno);
+		_impl->runCompletions();
+	}
+}
+
+shared_ptr<RC2::PGDBConnection>
+RC2::IOWorker::connection() const
+{
+	return _impl->connection_;
+}
+
+bool
+RC2::IOWorker::idle() const
+{
+	return _impl->outstanding_ == 0;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <functional>
+#include <event2/event.h>
+#include "common/PGDBConnection.hpp"
+
+namespace RC2 {
+
+	//Runs database and disk work on a background thread with its own database connection,
+	// so it overlaps with R evaluation on the main thread. Jobs run one at a time in the
+	// order they were posted. Completions run afterwards on the thread running eventBase.
+	class IOWorker {
+	public:
+		typedef std::function<void (PGDBConnection&)> Job;
+		typedef std::function<void ()> Completion;
+
+		//connection must be open and not used by anything else
+		IOWorker(struct event_base *eventBase, std::shared_ptr<PGDBConnection> connection);
+		virtual ~IOWorker();
+
+		//must only be called from the event loop thread. The completion is not called if
+		// the job throws an exception
+		void	post(Job job, Completion completion = nullptr);
+		//blocks until all posted jobs have finished and their completions have run
+		void	drain();
+		bool	idle() const;
+		//the worker's connection. Only use it from a job or after drain()
+		std::shared_ptr<PGDBConnection>	connection() const;
+
+	private:
+		class Impl;
+		std::unique_ptr<Impl>	_impl;
+	};
+
+};
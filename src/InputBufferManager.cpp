@@ -1,14 +1,25 @@
 #include <iostream>
 #include <string>
 #include <memory>
+#include <streambuf>
+#include <arpa/inet.h>
 #include "InputBufferManager.hpp"
 
 using namespace std;
 
 const uint32_t kRSessionMagicNumber = 0x21;
+const size_t kDefaultMaxFrameSize = 64 * 1024 * 1024;
+static const size_t kFrameHeaderSize = 8;
 
+//read-only istream source over memory owned by someone else
+struct MemoryStreamBuf : public std::streambuf {
+	MemoryStreamBuf(char *data, size_t length) {
+		setg(data, data, data + length);
+	}
+};
 
-RC2::InputBufferManager::InputBufferManager()
+RC2::InputBufferManager::InputBufferManager(size_t maxFrameSize)
+	: _maxFrameSize(maxFrameSize), _bytesToDiscard(0)
 {
 	_buffer = evbuffer_new();
 }
@@ -21,47 +32,88 @@ RC2::InputBufferManager::~InputBufferManager()
 void
 RC2::InputBufferManager::appendData(struct evbuffer *inBuffer)
 {
+	//moves the chains, does not copy the data
 	if (evbuffer_add_buffer(_buffer, inBuffer) == -1) {
 		cerr << "failed to append buffer" << endl;
 	}
-	size_t dataSize = evbuffer_get_length(_buffer);
-	if (dataSize > 8) {
-		char dataHead[8];
-		evbuffer_copyout(_buffer, dataHead, 8);
-		uint32_t magicIdent = ntohl(*((uint32_t*)&dataHead[0]));
-		uint32_t jsonSize = ntohl(*((uint32_t*)&dataHead[4]));
-		if (magicIdent != kRSessionMagicNumber) {
-			cerr << "bad magic number" << endl;
-			this->reset();
+	while (true) {
+		if (_bytesToDiscard > 0) {
+			size_t amount = min(_bytesToDiscard, evbuffer_get_length(_buffer));
+			evbuffer_drain(_buffer, amount);
+			_bytesToDiscard -= amount;
+			if (_bytesToDiscard > 0)
+				return;
+		}
+		size_t dataSize = evbuffer_get_length(_buffer);
+		if (dataSize < kFrameHeaderSize)
 			return;
+		uint32_t header[2];
+		evbuffer_copyout(_buffer, header, kFrameHeaderSize);
+		if (ntohl(header[0]) != kRSessionMagicNumber) {
+			cerr << "bad magic number" << endl;
+			if (!resync())
+				return;
+			continue;
 		}
-		if ((jsonSize + 8) <= dataSize) {
-			std::unique_ptr<char[]> buff(new char[dataSize]);
-			evbuffer_remove(_buffer, buff.get(), dataSize);
-			_currentJson += string(&buff.get()[8], jsonSize);
+		size_t jsonSize = ntohl(header[1]);
+		if (jsonSize > _maxFrameSize) {
+			cerr << "dropping frame of " << jsonSize << " bytes" << endl;
+			_bytesToDiscard = kFrameHeaderSize + jsonSize;
+			continue;
 		}
+		if (dataSize < kFrameHeaderSize + jsonSize)
+			return;
+		evbuffer_drain(_buffer, kFrameHeaderSize);
+		parseFrame(jsonSize);
+		evbuffer_drain(_buffer, jsonSize);
+	}
+}
+
+//parses the json at the front of the buffer. pullup only moves data if the frame spans chains
+void
+RC2::InputBufferManager::parseFrame(size_t jsonSize)
+{
+	char *data = reinterpret_cast<char*>(evbuffer_pullup(_buffer, jsonSize));
+	if (data == nullptr) {
+		cerr << "failed to access frame data" << endl;
+		return;
+	}
+	MemoryStreamBuf streamBuf(data, jsonSize);
+	std::istream stream(&streamBuf);
+	try {
+		_messages.push(json2::parse(stream));
+	} catch (std::exception &ex) {
+		cerr << "invalid json in frame:" << ex.what() << endl;
 	}
 }
 
+//discards data up to the next magic number. returns false if there isn't one yet
 bool
-RC2::InputBufferManager::hasCompleteMessage()
+RC2::InputBufferManager::resync()
 {
-	return _currentJson.length() > 0;
+	uint32_t magic = htonl(kRSessionMagicNumber);
+	struct evbuffer_ptr found = evbuffer_search(_buffer, reinterpret_cast<const char*>(&magic), 
+		sizeof(magic), nullptr);
+	if (found.pos < 0) {
+		//keep enough that a magic number split across reads is still found
+		size_t dataSize = evbuffer_get_length(_buffer);
+		evbuffer_drain(_buffer, dataSize - (sizeof(magic) - 1));
+		return false;
+	}
+	evbuffer_drain(_buffer, found.pos);
+	return true;
 }
 
-std::string
-RC2::InputBufferManager::popCurrentMessage()
+bool
+RC2::InputBufferManager::hasCompleteMessage() const
 {
-	string str(_currentJson);
-	_currentJson = "";
-	return str;
+	return !_messages.empty();
 }
 
-void
-RC2::InputBufferManager::reset()
+json2
+RC2::InputBufferManager::popCurrentMessage()
 {
-	size_t dataSize = evbuffer_get_length(_buffer);
-	evbuffer_drain(_buffer, dataSize);
-	_expectedSize = 0;
-	_currentJson = "";
+	json2 msg = std::move(_messages.front());
+	_messages.pop();
+	return msg;
 }
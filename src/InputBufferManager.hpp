@@ -3,28 +3,39 @@
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <memory>
+#include <queue>
 #include <boost/noncopyable.hpp>
+#include "json.hpp"
 
 extern const uint32_t kRSessionMagicNumber;
+extern const size_t kDefaultMaxFrameSize;
+
+using json2 = nlohmann::json;
 
 namespace RC2 {
 
+	//Splits the input stream into frames (magic number, json length, json) and parses
+	// each frame's json straight out of the evbuffer. Any number of frames can arrive
+	// in a single read, or a frame can arrive across several reads.
 	class InputBufferManager : private boost::noncopyable {
 	
 		public:
-			InputBufferManager();
+			InputBufferManager(size_t maxFrameSize = kDefaultMaxFrameSize);
 			virtual ~InputBufferManager();
 			
+			//moves the data out of inBuffer and parses every complete frame
 			void appendData(struct evbuffer *inBuffer);
-			bool hasCompleteMessage();
-			std::string popCurrentMessage();
+			bool hasCompleteMessage() const;
+			json2 popCurrentMessage();
 			
 		private:
-			void reset();
+			void parseFrame(size_t jsonSize);
+			bool resync();
 		
 			struct evbuffer*	_buffer;
-			int32_t				_expectedSize;
-			std::string			_currentJson;
+			size_t				_maxFrameSize;
+			size_t				_bytesToDiscard;
+			std::queue<json2>	_messages;
 	};
 
 };
@@ -6,7 +6,7 @@ namespace RC2 {
 	
 	enum class CommandType {
 		Unknown=-1, Open, Close, ClearFileChanges, ExecScript, ExecFile,
-		Help, ListVariables, GetVariable, ToggleWatch, SaveData
+		Help, ListVariables, GetVariable, GetSummary, ToggleWatch, SaveData
 	};
 	
 	class JsonCommand {
@@ -15,9 +15,9 @@ namespace RC2 {
 	public:
 		
 		JsonCommand(json2::value_type cmd)
-			: _cmd(cmd)
+			: _cmd(std::move(cmd))
 			{
-				std::string cmdStr = cmd["msg"];
+				std::string cmdStr = _cmd["msg"];
 				if (cmdStr == "open") _type = CommandType::Open;
 				if (cmdStr == "close") _type = CommandType::Close;
 				if (cmdStr == "saveEnv") _type = CommandType::SaveData;
@@ -27,6 +27,7 @@ namespace RC2 {
 				if (cmdStr == "help") _type = CommandType::Help;
 				if (cmdStr == "listVariables") _type = CommandType::ListVariables;
 				if (cmdStr == "getVariable") _type = CommandType::GetVariable;
+				if (cmdStr == "getSummary") _type = CommandType::GetSummary;
 				if (cmdStr == "toggleVariableWatch") _type = CommandType::ToggleWatch;
 			}
 			
@@ -8,6 +8,8 @@
 #include <cstdlib>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 #include "RServer.hpp"
 #include "tclap/CmdLine.h"
 #include "common/RC2Utils.hpp"
@@ -20,21 +22,38 @@ namespace fs = boost::filesystem;
 
 static void event_callback(evutil_socket_t socket, short events, void *objptr);
 static void terminate_app(evutil_socket_t socket, short events, void *objptr);
+static void pool_callback(evutil_socket_t socket, short events, void *objptr);
+static void refill_callback(evutil_socket_t socket, short events, void *objptr);
+static void zygote_callback(evutil_socket_t socket, short events, void *objptr);
+static void zygote_restart_callback(evutil_socket_t socket, short events, void *objptr);
+static void stats_callback(evutil_socket_t socket, short events, void *objptr);
 
 RServer::RServer()
 {
 	signal(SIGCHLD, SIG_IGN); //auto-reap child processes
 	_port = 7714;
+	_poolSize = 0;
+	_refillScheduled = false;
+	_useZygote = false;
+	_zygotePid = 0;
+	_zygoteSocket = -1;
+	_zygoteEvent = nullptr;
 	struct event_config *config = event_config_new();
 	event_config_require_features(config, EV_FEATURE_FDS);
 	_eventBase = event_base_new_with_config(config);
 	event_config_free(config);
 
 	event_new(_eventBase, SIGINT, EV_SIGNAL|EV_PERSIST, terminate_app, this);
+	_statsEvent = event_new(_eventBase, SIGUSR1, EV_SIGNAL|EV_PERSIST, stats_callback, this);
+	event_add(_statsEvent, nullptr);
 }
 
 RServer::~RServer()
 {
+	while (!_pool.empty())
+		removePooledSession(_pool.begin());
+	stopZygote();
+	event_free(_statsEvent);
 	event_base_free(_eventBase);
 }
 
@@ -67,6 +86,10 @@ RServer::startRunLoop()
 		exit(-1);
 	}
 	event_add(listener_event, nullptr);
+	if (_useZygote)
+		startZygote();
+	else
+		fillPool();
 	
 	int drc = event_base_dispatch(_eventBase);
 	cerr << "dispatch:" << drc << endl;
@@ -75,11 +98,6 @@ RServer::startRunLoop()
 void
 RServer::handleEvent(evutil_socket_t listener, short events)
 {
-	const char *libKey = "R_Libs";
-	string installLoc = RC2::GetPathForExecutable(getpid());
-	string::size_type pos = installLoc.rfind('/');
-	string path = installLoc.substr(0, pos) + "/rsession";
-
 	struct sockaddr_in clientAddr;
 	socklen_t clientLen = sizeof(clientAddr);
 	int clientSock = accept(listener, (struct sockaddr*)&clientAddr, &clientLen);
@@ -90,6 +108,24 @@ RServer::handleEvent(evutil_socket_t listener, short events)
 	_verbose && cout << "client accepted" << endl;
 	int option = 1;
 	setsockopt(clientSock, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+	if (_useZygote ? handOffToZygote(clientSock) : handOffToPool(clientSock))
+		return;
+	launchSession(clientSock);
+}
+
+string
+RServer::rsessionPath() const
+{
+	string installLoc = RC2::GetPathForExecutable(getpid());
+	string::size_type pos = installLoc.rfind('/');
+	return installLoc.substr(0, pos) + "/rsession";
+}
+
+//fork/exec a fresh rsession for clientSock. used when no pooled session is ready
+void
+RServer::launchSession(int clientSock)
+{
+	string path = rsessionPath();
 	char pidstr[16];
 	sprintf(pidstr, "%d", clientSock);
 	const char *args[5];
@@ -106,8 +142,243 @@ RServer::handleEvent(evutil_socket_t listener, short events)
 		exit(0);
 	} else if (forkResult == -1) {
 		std::cerr << "failed to fork:" << errno << std::endl;
-		close(clientSock);
 	}
+	close(clientSock);
+}
+
+//passes clientSock to the first ready pooled session. returns false if none could take it
+bool
+RServer::handOffToPool(int clientSock)
+{
+	auto itr = _pool.begin();
+	while (itr != _pool.end()) {
+		if (!itr->ready) {
+			++itr;
+			continue;
+		}
+		int rc = RC2::SendFileDescriptor(itr->controlSocket, clientSock);
+		auto current = itr++;
+		removePooledSession(current);
+		if (rc == 0) {
+			_verbose && cout << "client handed to pooled session" << endl;
+			close(clientSock);
+			schedulePoolRefill(0);
+			return true;
+		}
+		cerr << "failed to pass client to pooled session: " << errno << endl;
+	}
+	schedulePoolRefill(0);
+	return false;
+}
+
+bool
+RServer::spawnPooledSession()
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+		cerr << "socketpair failed: " << errno << endl;
+		return false;
+	}
+	string path = rsessionPath();
+	char fdstr[16];
+	sprintf(fdstr, "%d", fds[1]);
+	const char *args[5];
+	args[0] = "rsession";
+	args[1] = "-w";
+	args[2] = fdstr;
+	args[3] = _verbose ? "-v" : nullptr;
+	args[4] = nullptr;
+	int forkResult = fork();
+	if (forkResult == 0) {
+		close(fds[0]);
+		fcntl(fds[1], F_SETFD, 0); //child end must survive execve
+		execve(path.c_str(), (char *const *)args, environ);
+		std::cerr << "Error with execve:" << errno << std::endl;
+		exit(0);
+	}
+	close(fds[1]);
+	if (forkResult == -1) {
+		std::cerr << "failed to fork:" << errno << std::endl;
+		close(fds[0]);
+		return false;
+	}
+	PooledSession session;
+	session.pid = forkResult;
+	session.controlSocket = fds[0];
+	session.ready = false;
+	session.readyEvent = event_new(_eventBase, fds[0], EV_READ|EV_PERSIST, pool_callback, this);
+	event_add(session.readyEvent, nullptr);
+	_pool.push_back(session);
+	return true;
+}
+
+void
+RServer::removePooledSession(std::list<PooledSession>::iterator itr)
+{
+	event_free(itr->readyEvent);
+	close(itr->controlSocket);
+	_pool.erase(itr);
+}
+
+//a pooled session writes a single byte once R is initialized. eof means it exited
+void
+RServer::handlePoolEvent(evutil_socket_t controlSocket, short events)
+{
+	for (auto itr = _pool.begin(); itr != _pool.end(); ++itr) {
+		if (itr->controlSocket != controlSocket)
+			continue;
+		char status;
+		ssize_t rc = read(controlSocket, &status, sizeof(status));
+		if (rc == 1) {
+			itr->ready = true;
+			_verbose && cout << "pooled session " << itr->pid << " ready" << endl;
+		} else if (rc == 0 || (rc < 0 && errno != EAGAIN && errno != EINTR)) {
+			cerr << "pooled session " << itr->pid << " exited" << endl;
+			removePooledSession(itr);
+			//delay so a session that fails on startup doesn't cause a fork loop
+			schedulePoolRefill(1);
+		}
+		return;
+	}
+}
+
+void
+RServer::fillPool()
+{
+	_refillScheduled = false;
+	while (_pool.size() < _poolSize) {
+		if (!spawnPooledSession()) {
+			schedulePoolRefill(1);
+			return;
+		}
+	}
+}
+
+void
+RServer::schedulePoolRefill(long delaySeconds)
+{
+	if (_refillScheduled || _pool.size() >= _poolSize)
+		return;
+	_refillScheduled = true;
+	struct timeval delay = {delaySeconds, 0};
+	event_base_once(_eventBase, -1, EV_TIMEOUT, refill_callback, this, &delay);
+}
+
+void
+RServer::startZygote()
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+		cerr << "socketpair failed: " << errno << endl;
+		scheduleZygoteRestart();
+		return;
+	}
+	string path = rsessionPath();
+	char fdstr[16];
+	sprintf(fdstr, "%d", fds[1]);
+	const char *args[5];
+	args[0] = "rsession";
+	args[1] = "-z";
+	args[2] = fdstr;
+	args[3] = _verbose ? "-v" : nullptr;
+	args[4] = nullptr;
+	int forkResult = fork();
+	if (forkResult == 0) {
+		close(fds[0]);
+		fcntl(fds[1], F_SETFD, 0); //child end must survive execve
+		execve(path.c_str(), (char *const *)args, environ);
+		std::cerr << "Error with execve:" << errno << std::endl;
+		exit(0);
+	}
+	close(fds[1]);
+	if (forkResult == -1) {
+		std::cerr << "failed to fork zygote:" << errno << std::endl;
+		close(fds[0]);
+		scheduleZygoteRestart();
+		return;
+	}
+	_zygotePid = forkResult;
+	_zygoteSocket = fds[0];
+	_zygoteEvent = event_new(_eventBase, fds[0], EV_READ|EV_PERSIST, zygote_callback, this);
+	event_add(_zygoteEvent, nullptr);
+	_verbose && cout << "started zygote " << _zygotePid << endl;
+}
+
+void
+RServer::stopZygote()
+{
+	if (_zygoteSocket == -1)
+		return;
+	event_free(_zygoteEvent);
+	_zygoteEvent = nullptr;
+	//the zygote exits when its control socket closes. sessions it forked keep running
+	close(_zygoteSocket);
+	_zygoteSocket = -1;
+	_zygotePid = 0;
+}
+
+void
+RServer::scheduleZygoteRestart()
+{
+	//delay so a zygote that fails on startup doesn't cause a fork loop
+	struct timeval delay = {1, 0};
+	event_base_once(_eventBase, -1, EV_TIMEOUT, zygote_restart_callback, this, &delay);
+}
+
+//the zygote queues client sockets until R is initialized, so no ready check is needed
+bool
+RServer::handOffToZygote(int clientSock)
+{
+	if (_zygoteSocket == -1)
+		return false;
+	if (RC2::SendFileDescriptor(_zygoteSocket, clientSock) != 0) {
+		cerr << "failed to pass client to zygote: " << errno << endl;
+		stopZygote();
+		scheduleZygoteRestart();
+		return false;
+	}
+	close(clientSock);
+	return true;
+}
+
+//the zygote writes the pid of each session it forks. eof means it exited
+void
+RServer::handleZygoteEvent(evutil_socket_t controlSocket, short events)
+{
+	int32_t pid;
+	ssize_t rc = recv(controlSocket, &pid, sizeof(pid), MSG_WAITALL);
+	if (rc == sizeof(pid)) {
+		_zygoteChildren.insert(pid);
+		_verbose && cout << "zygote forked session " << pid << endl;
+	} else if (rc == 0 || (rc < 0 && errno != EAGAIN && errno != EINTR)) {
+		cerr << "zygote " << _zygotePid << " exited" << endl;
+		stopZygote();
+		scheduleZygoteRestart();
+	}
+}
+
+void
+RServer::reportMemoryUsage()
+{
+	RC2::ProcessMemoryUsage usage;
+	if (_zygotePid > 0 && RC2::ReadProcessMemoryUsage(_zygotePid, usage)) {
+		cerr << "zygote " << _zygotePid << ": rss=" << usage.rss << "kB pss=" << usage.pss 
+			<< "kB shared=" << usage.shared << "kB" << endl;
+	}
+	long totalRss = 0, totalPss = 0;
+	for (auto itr = _zygoteChildren.begin(); itr != _zygoteChildren.end(); ) {
+		if (!RC2::ReadProcessMemoryUsage(*itr, usage)) {
+			//session has exited
+			itr = _zygoteChildren.erase(itr);
+			continue;
+		}
+		cerr << "session " << *itr << ": rss=" << usage.rss << "kB pss=" << usage.pss 
+			<< "kB shared=" << usage.shared << "kB private=" << usage.unshared << "kB" << endl;
+		totalRss += usage.rss;
+		totalPss += usage.pss;
+		++itr;
+	}
+	cerr << _zygoteChildren.size() << " sessions: rss=" << totalRss << "kB pss=" << totalPss << "kB" << endl;
 }
 
 bool
@@ -119,10 +390,17 @@ RServer::parseArgs(int argc, char** argv)
 		TCLAP::ValueArg<uint32_t> portArg("p", "port", "port to listen on", 
 			false, 7714, "port", cmdLine);
 		
+		TCLAP::ValueArg<uint32_t> poolArg("w", "warm-pool", "number of pre-started rsessions to keep ready", 
+			false, 2, "count", cmdLine);
+		
+		TCLAP::SwitchArg zygoteArg("z", "zygote", "fork sessions from a single initialized rsession instead of a warm pool", cmdLine);
+		
 		TCLAP::SwitchArg switchArg("v", "verbose", "enable logging", cmdLine);
 			
 		cmdLine.parse(argc, argv);
 		_port = portArg.getValue();
+		_poolSize = poolArg.getValue();
+		_useZygote = zygoteArg.getValue();
 		_verbose = switchArg.getValue();
 		
 	} catch (TCLAP::ArgException &e) {
@@ -144,6 +422,41 @@ terminate_app(evutil_socket_t socket, short events, void *objptr)
 	server->terminate();
 }
 
+static void
+pool_callback(evutil_socket_t socket, short events, void *objptr)
+{
+	RServer *server = static_cast<RServer*>(objptr);
+	server->handlePoolEvent(socket, events);
+}
+
+static void
+refill_callback(evutil_socket_t socket, short events, void *objptr)
+{
+	RServer *server = static_cast<RServer*>(objptr);
+	server->fillPool();
+}
+
+static void
+zygote_callback(evutil_socket_t socket, short events, void *objptr)
+{
+	RServer *server = static_cast<RServer*>(objptr);
+	server->handleZygoteEvent(socket, events);
+}
+
+static void
+zygote_restart_callback(evutil_socket_t socket, short events, void *objptr)
+{
+	RServer *server = static_cast<RServer*>(objptr);
+	server->startZygote();
+}
+
+static void
+stats_callback(evutil_socket_t socket, short events, void *objptr)
+{
+	RServer *server = static_cast<RServer*>(objptr);
+	server->reportMemoryUsage();
+}
+
 static void 
 event_callback(evutil_socket_t socket, short events, void *objptr)
 {
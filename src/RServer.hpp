@@ -9,6 +9,10 @@
 #define	RSERVER_HPP
 
 #include <event2/event.h>
+#include <sys/types.h>
+#include <list>
+#include <set>
+#include <string>
 #include <boost/noncopyable.hpp>
 
 class RServer : private boost::noncopyable
@@ -21,12 +25,45 @@ public:
 	void	startRunLoop();
 	void	terminate();
 	void handleEvent(evutil_socket_t listener, short events);
+	void handlePoolEvent(evutil_socket_t controlSocket, short events);
+	void handleZygoteEvent(evutil_socket_t controlSocket, short events);
+	void fillPool();
+	void startZygote();
+	//writes rss/pss for the zygote and each of its children to stderr
+	void reportMemoryUsage();
 
 private:
-	struct event_base*	_eventBase;
-	bool				_verbose;
-	uint				_port;
-	int					_socket;
+	//an rsession that has been started with R initialized and is waiting for a client socket
+	struct PooledSession {
+		pid_t			pid;
+		int				controlSocket;
+		bool			ready;
+		struct event*	readyEvent;
+	};
+
+	std::string	rsessionPath() const;
+	void	launchSession(int clientSock);
+	bool	handOffToPool(int clientSock);
+	bool	spawnPooledSession();
+	void	removePooledSession(std::list<PooledSession>::iterator itr);
+	void	schedulePoolRefill(long delaySeconds);
+	bool	handOffToZygote(int clientSock);
+	void	stopZygote();
+	void	scheduleZygoteRestart();
+
+	struct event_base*		_eventBase;
+	bool					_verbose;
+	uint					_port;
+	uint					_poolSize;
+	bool					_refillScheduled;
+	bool					_useZygote;
+	pid_t					_zygotePid;
+	int						_zygoteSocket;
+	struct event*			_zygoteEvent;
+	struct event*			_statsEvent;
+	std::set<pid_t>			_zygoteChildren;
+	int						_socket;
+	std::list<PooledSession> _pool;
 };
 
 #endif	/* RSERVER_HPP */
@@ -33,13 +33,6 @@ main(int argc, char** argv)
 {
 	std::set_terminate(exitHandler);
 
-	using namespace g3;
-	std::unique_ptr<LogWorker> logworker{ LogWorker::createLogWorker() };
-	auto sinkHandle = logworker->addSink(std2::make_unique<RC2::CustomSink>(),
-										 &RC2::CustomSink::ReceiveLogMessage);
-	
-	// initialize the logger before it can receive LOG calls
-	initializeLogging(logworker.get());
 	if (fs::exists("/usr/lib/R"))
 		setenv("R_HOME", "/usr/lib/R", 0);
 	else
@@ -48,10 +41,24 @@ main(int argc, char** argv)
 	callbacks = new RC2::RSessionCallbacks();
 	session = new RC2::RSession(callbacks);
 	session->parseArguments(argc, argv);
+	//in zygote mode this returns in a forked child, so logging (and its worker thread)
+	// can't be started until after it returns
+	if (!session->awaitClientConnection()) {
+		cerr << "no client connection" << endl;
+		return 1;
+	}
+
+	using namespace g3;
+	std::unique_ptr<LogWorker> logworker{ LogWorker::createLogWorker() };
+	auto sinkHandle = logworker->addSink(std2::make_unique<RC2::CustomSink>(),
+										 &RC2::CustomSink::ReceiveLogMessage);
+	
+	// initialize the logger before it can receive LOG calls
+	initializeLogging(logworker.get());
+
 	session->prepareForRunLoop();
 	session->installExitHandler(signalHandler);
 	session->startEventLoop();
 	cerr << "event loop exited" << endl;
     return 0;
 }
-
@@ -6,6 +6,7 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <unistd.h>
 #include <boost/log/utility/setup/file.hpp>
 #define BOOST_NO_CXX11_SCOPED_ENUMS
@@ -28,6 +29,8 @@
 #include "common/ZeroInitializedStruct.hpp"
 #include "FileManager.hpp"
 #include "EnvironmentWatcher.hpp"
+#include "WorkspaceCheckpointer.hpp"
+#include "BinaryVariableWriter.hpp"
 
 using namespace std;
 namespace fs = boost::filesystem;
@@ -68,29 +71,49 @@ struct RC2::RSession::Impl : public ZeroInitializedStruct {
 	struct event_base*				eventBase;
 	struct bufferevent*				eventBuffer;
 	struct evbuffer*				outBuffer;
+	struct event*					flushEvent;
+	struct event*					checkpointEvent;
 	InputBufferManager				inputBuffer;
 	RInside*						R;
+	//before fileManager so it outlives checkpoint completions run when that is destroyed
+	unique_ptr<WorkspaceCheckpointer>	checkpointer;
 	unique_ptr<FileManager>			fileManager;
 	unique_ptr<TemporaryDirectory>	tmpDir;
 	unique_ptr<EnvironmentWatcher>	envWatcher;
 	shared_ptr<string>				consoleOutBuffer;
 	string							stdOutCapture;
+	string							fileCacheDir;
+	int								fileCacheMB;
 	double							consoleLastWrite;
 	int								wspaceId;
 	int								sessionRecId;
 	int								socket;
+	int								poolSocket;
 	int								currentQueryId;
+	int								outputSequence;
+	int								streamIntervalMs;
+	int								checkpointIntervalSecs;
+	BlobCodec						workspaceCodec;
+	size_t							streamThreshold;
 	bool							open;
 	bool							ignoreOutput;
 	bool							captureStdOut;
 	bool							sourceInProgress;
 	bool							watchVariables;
 	bool 							properlyClosed;
+	bool							packagesLoaded;
+	bool							zygote;
+	bool							flushScheduled;
+	bool							binaryVariables;
+	bool							commandSinceCheckpoint; //only commands change the workspace
 
 			Impl();
 			Impl(const Impl &copy) = delete;
 			Impl& operator=(const Impl&) = delete;
 			void	addImagesToJson(json2& json);
+			bool	shouldStreamOutput() const;
+			bool	restoreCheckpoint();
+			bool	checkpoint(bool wait);
 	string	acknowledgeExecComplete(JsonCommand &command, int queryId, bool expectShowOutput);
 
 	static void handleExecComplete(int fd, short event_type, void *ctx) 
@@ -99,8 +122,7 @@ struct RC2::RSession::Impl : public ZeroInitializedStruct {
 		bool gotFileInfo = args->finfo.id > 0;
 		LOG(INFO) << "got ack with file " << gotFileInfo;
 		string s = args->session->_impl->acknowledgeExecComplete(args->command, args->queryId, gotFileInfo);
-		LOG(INFO) << "handleExecComplete got json:" << s;
-		args->session->sendJsonToClientSource(s);
+		args->session->sendJsonToClientSource(std::move(s));
 		if (gotFileInfo) {
 			args->session->_impl->fileManager->fileInfoForId(args->finfo.id, args->finfo);
 			json2 results = { 
@@ -113,6 +135,28 @@ struct RC2::RSession::Impl : public ZeroInitializedStruct {
 		delete args;
 	}
 	
+	//runs once per event loop turn in which output was queued, so all the messages
+	// from that turn go to the socket in a single write
+	static void handleOutputFlush(int fd, short event_type, void *ctx)
+	{
+		RC2::RSession *session = reinterpret_cast<RC2::RSession*>(ctx);
+		session->_impl->flushScheduled = false;
+		bufferevent_write_buffer(session->_impl->eventBuffer, session->_impl->outBuffer);
+	}
+	
+	static void handleCheckpointTimer(int fd, short event_type, void *ctx)
+	{
+		Impl *impl = reinterpret_cast<Impl*>(ctx);
+		//digesting every variable isn't free, so an idle workspace isn't checked again
+		if (impl->open && !impl->properlyClosed && impl->commandSinceCheckpoint)
+			impl->checkpoint(false);
+	}
+	
+	static void releaseOutputString(const void *data, size_t len, void *ctx)
+	{
+		delete reinterpret_cast<string*>(ctx);
+	}
+	
 	static void handleDelayedCommand(int fd, short event_type, void *ctx) 
 	{
 		DelayCommandArgs *args = reinterpret_cast<DelayCommandArgs*>(ctx);
@@ -145,6 +189,73 @@ struct RC2::RSession::Impl : public ZeroInitializedStruct {
 RC2::RSession::Impl::Impl()
 	: consoleOutBuffer(new string)
 {
+	poolSocket = -1;
+	fileCacheDir = "/tmp/rc2-filecache";
+	fileCacheMB = 2048;
+	streamIntervalMs = 250;
+	streamThreshold = 32 * 1024;
+	checkpointIntervalSecs = 300;
+	workspaceCodec = BlobCodec::Zlib;
+}
+
+//R blocks the event loop while evaluating, so streaming is driven from the console callback
+bool
+RC2::RSession::Impl::shouldStreamOutput() const
+{
+	if (streamThreshold > 0 && consoleOutBuffer->length() >= streamThreshold)
+		return true;
+	if (streamIntervalMs > 0 && (currentFractionalSeconds() - consoleLastWrite) * 1000 >= streamIntervalMs)
+		return true;
+	return false;
+}
+
+//returns false if there is no checkpoint, in which case .RData should be loaded
+bool
+RC2::RSession::Impl::restoreCheckpoint()
+{
+	if (!fileManager->checkpointAvailable())
+		return false;
+	checkpointer.reset(new WorkspaceCheckpointer(Rcpp::Environment::global_env()));
+	bool restored = fileManager->loadCheckpoint([this](const CheckpointVariable &var) {
+		checkpointer->restore(var);
+	});
+	if (restored)
+		checkpointer->restoreComplete();
+	return restored;
+}
+
+//sends the variables that changed since the last checkpoint. Returns false if
+// checkpoints aren't available or a waited for one failed
+bool
+RC2::RSession::Impl::checkpoint(bool wait)
+{
+	//also finishes earlier checkpoints so their confirmations are seen
+	if (!checkpointer || !fileManager->checkpointAvailable())
+		return false;
+	vector<CheckpointVariable> changed;
+	vector<string> removed;
+	bool replace;
+	long generation;
+	try {
+		generation = checkpointer->collectChanges(changed, removed, replace);
+	} catch (std::exception &e) {
+		LOG(WARNING) << "checkpoint failed: " << e.what();
+		return false;
+	}
+	commandSinceCheckpoint = false;
+	if (!replace && changed.empty() && removed.empty()) {
+		checkpointer->confirm(generation);
+		return true;
+	}
+	WorkspaceCheckpointer *cp = checkpointer.get();
+	try {
+		fileManager->saveCheckpoint(std::move(changed), std::move(removed), replace, wait, 
+			[cp, generation]() { cp->confirm(generation); });
+	} catch (std::exception &e) {
+		LOG(WARNING) << "checkpoint failed: " << e.what();
+		return false;
+	}
+	return true;
 }
 
 void
@@ -226,6 +337,10 @@ RC2::RSession::~RSession()
 		delete _impl->R;
 		_impl->R = nullptr;
 	}
+	if (nullptr != _impl->flushEvent)
+		event_free(_impl->flushEvent);
+	if (nullptr != _impl->checkpointEvent)
+		event_free(_impl->checkpointEvent);
 	if (nullptr != _impl->outBuffer)
 		evbuffer_free(_impl->outBuffer);
 	LOG(INFO) << "RSession destroyed";
@@ -242,11 +357,18 @@ RC2::RSession::consoleCallback(const string &text, bool is_error)
 	if (_impl->ignoreOutput)
 		return;
 	if (is_error) {
+		//keep stdout that preceded the error in order
+		sendOutputBufferToClient(false);
 		string errstr = formatStringAsJson(text, true);
 		sendJsonToClientSource(errstr);
+		pushOutputToSocket();
 	} else {
 		if (R_Visible || _impl->sourceInProgress) {
 			_impl->consoleOutBuffer->append(text);
+			if (_impl->shouldStreamOutput()) {
+				sendOutputBufferToClient(false);
+				pushOutputToSocket();
+			}
 		}
 	}
 }
@@ -258,12 +380,54 @@ RC2::RSession::parseArguments(int argc, char *argv[])
 		TCLAP::CmdLine cmdLine("Handle a remote R connection", ' ', "0.1");
 		
 		TCLAP::ValueArg<int> portArg("s", "socket", "socket to listen on", 
-			true, -1, "socketnum", cmdLine);
+			true, -1, "socketnum");
+		TCLAP::ValueArg<int> poolArg("w", "warm-pool", "unix socket to receive client socket on", 
+			true, -1, "socketnum");
+		TCLAP::ValueArg<int> zygoteArg("z", "zygote", "unix socket to receive client sockets to fork for", 
+			true, -1, "socketnum");
+		vector<TCLAP::Arg*> socketArgs = { &portArg, &poolArg, &zygoteArg };
+		cmdLine.xorAdd(socketArgs);
+		
+		TCLAP::ValueArg<int> intervalArg("i", "stream-interval", 
+			"milliseconds between partial output messages (0 to disable)", 
+			false, _impl->streamIntervalMs, "ms", cmdLine);
+		TCLAP::ValueArg<int> thresholdArg("k", "stream-size", 
+			"kilobytes of output that force a partial output message (0 to disable)", 
+			false, _impl->streamThreshold / 1024, "kb", cmdLine);
+		
+		TCLAP::ValueArg<string> cacheArg("c", "file-cache", 
+			"directory for workspace file contents shared by sessions (empty to disable)", 
+			false, _impl->fileCacheDir, "path", cmdLine);
+		TCLAP::ValueArg<int> cacheSizeArg("m", "file-cache-size", 
+			"megabytes the file cache can use before least recently used files are removed", 
+			false, _impl->fileCacheMB, "mb", cmdLine);
+		
+		TCLAP::ValueArg<int> checkpointArg("p", "checkpoint-interval", 
+			"seconds between background checkpoints of changed variables (0 to disable)", 
+			false, _impl->checkpointIntervalSecs, "seconds", cmdLine);
+		
+		vector<string> codecNames = {"none", "zlib"};
+		TCLAP::ValuesConstraint<string> codecConstraint(codecNames);
+		TCLAP::ValueArg<string> codecArg("x", "workspace-codec", 
+			"compression for stored workspace data. R skips its own .RData compression when this applies", 
+			false, "zlib", &codecConstraint, cmdLine);
 		
 		TCLAP::SwitchArg switchArg("v", "verbose", "enable logging", cmdLine);
 			
 		cmdLine.parse(argc, argv);
+		_impl->streamIntervalMs = intervalArg.getValue();
+		_impl->streamThreshold = thresholdArg.getValue() * 1024;
+		_impl->fileCacheDir = cacheArg.getValue();
+		_impl->fileCacheMB = cacheSizeArg.getValue();
+		_impl->checkpointIntervalSecs = checkpointArg.getValue();
+		_impl->workspaceCodec = BlobCodecNamed(codecArg.getValue());
 		_impl->socket = portArg.getValue();
+		if (poolArg.isSet())
+			_impl->poolSocket = poolArg.getValue();
+		if (zygoteArg.isSet()) {
+			_impl->poolSocket = zygoteArg.getValue();
+			_impl->zygote = true;
+		}
 		bool verbose = switchArg.getValue();
 		if (verbose) {
 			setenv("GLOG_minloglevel", "1", 1);
@@ -273,14 +437,79 @@ RC2::RSession::parseArguments(int argc, char *argv[])
 //			logging::trivial::severity >= (verbose ? logging::trivial::info : logging::trivial::warning)
 //		);
 		
-		LOG(INFO) << "arguments parsed\n";
-		
 	} catch (TCLAP::ArgException &e) {
-		LOG(FATAL) << "error:" << e.error();
+		//logging has not been started yet
+		cerr << "error:" << e.error() << endl;
+		exit(1);
 	}
 	return true;
 }
 
+void
+RC2::RSession::preloadPackages()
+{
+	if (_impl->packagesLoaded)
+		return;
+	bool wasIgnoring = _impl->ignoreOutput;
+	_impl->ignoreOutput = true;
+	_impl->R->parseEvalQNT("library(rc2)");
+	_impl->R->parseEvalQNT("library(rmarkdown)");
+	_impl->R->parseEvalQNT("library(tools)");
+	_impl->ignoreOutput = wasIgnoring;
+	_impl->packagesLoaded = true;
+}
+
+bool
+RC2::RSession::awaitClientConnection()
+{
+	if (_impl->poolSocket < 0)
+		return _impl->socket > 0;
+	preloadPackages();
+	if (_impl->zygote)
+		return forkForClients();
+	char ready = 'R';
+	if (write(_impl->poolSocket, &ready, sizeof(ready)) != sizeof(ready)) {
+		cerr << "failed to signal rserver pool ready: " << errno << endl;
+		return false;
+	}
+	_impl->socket = ReceiveFileDescriptor(_impl->poolSocket);
+	close(_impl->poolSocket);
+	_impl->poolSocket = -1;
+	return _impl->socket > 0;
+}
+
+//zygote loop. R is initialized with packages loaded, so each child shares those
+// pages copy-on-write with this process. The child's pid is reported back to rserver
+bool
+RC2::RSession::forkForClients()
+{
+	signal(SIGCHLD, SIG_IGN); //auto-reap sessions
+	while (true) {
+		int clientSock = ReceiveFileDescriptor(_impl->poolSocket);
+		if (clientSock < 0) {
+			cerr << "zygote lost connection to rserver" << endl;
+			return false;
+		}
+		pid_t pid = fork();
+		if (pid == 0) {
+			signal(SIGCHLD, SIG_DFL); //texi2pdf uses waitpid
+			close(_impl->poolSocket);
+			_impl->poolSocket = -1;
+			_impl->zygote = false;
+			_impl->socket = clientSock;
+			return true;
+		}
+		close(clientSock);
+		if (pid == -1) {
+			cerr << "zygote failed to fork: " << errno << endl;
+			continue;
+		}
+		int32_t childPid = pid;
+		if (write(_impl->poolSocket, &childPid, sizeof(childPid)) != sizeof(childPid))
+			cerr << "zygote failed to report child pid: " << errno << endl;
+	}
+}
+
 void
 RC2::RSession::installExitHandler(void(*handler)(short flags))
 {
@@ -313,6 +542,8 @@ RC2::RSession::prepareForRunLoop()
 		bufferevent_enable(_impl->eventBuffer, EV_READ|EV_WRITE|BEV_OPT_DEFER_CALLBACKS);
 	}
 	_impl->outBuffer = evbuffer_new();
+	_impl->flushEvent = event_new(_impl->eventBase, -1, 0, RC2::RSession::Impl::handleOutputFlush, this);
+	event_priority_set(_impl->flushEvent, 2); //after other events of the same turn
 	_impl->fileManager->setEventBase(_impl->eventBase);
 	_impl->envWatcher.reset(new EnvironmentWatcher(Rcpp::Environment::global_env(), getExecuteCallback()));
 }
@@ -342,8 +573,8 @@ RC2::RSession::handleJsonStatic(struct bufferevent *bev, void *ctx)
 	try {
 		RC2::RSession *me = static_cast<RC2::RSession*>(ctx);
 		me->_impl->inputBuffer.appendData(bufferevent_get_input(bev));
-		if (me->_impl->inputBuffer.hasCompleteMessage()) {
-			me->handleJsonCommand(me->_impl->inputBuffer.popCurrentMessage());
+		while (me->_impl->inputBuffer.hasCompleteMessage()) {
+			me->handleJsonDocument(me->_impl->inputBuffer.popCurrentMessage());
 		}
 	} catch (exception const& e) {
 		LOG(WARNING) << "exception in handleJsonStatic:" << e.what();
@@ -358,6 +589,9 @@ RC2::RSession::handleCommand(JsonCommand& command)
 		return;
 	}
 	_impl->currentQueryId = command.raw().value("queryId", 0);
+	_impl->commandSinceCheckpoint = true;
+	_impl->outputSequence = 0;
+	_impl->consoleLastWrite = currentFractionalSeconds();
 	switch(command.type()) {
 		case CommandType::Close:
 			handleCloseCommand();
@@ -380,6 +614,9 @@ RC2::RSession::handleCommand(JsonCommand& command)
 		case CommandType::GetVariable:
 			handleGetVariableCommand(command);
 			break;
+		case CommandType::GetSummary:
+			handleGetSummaryCommand(command);
+			break;
 		case CommandType::ToggleWatch:
 			_impl->watchVariables = command.raw().value("watch", false);
 			if (_impl->watchVariables)
@@ -397,21 +634,28 @@ RC2::RSession::handleCommand(JsonCommand& command)
 void
 RC2::RSession::handleJsonCommand(string json)
 {
+	if (json.length() < 1)
+		return;
+	LOG(INFO) << "json=" << json;
+	json2 doc;
 	try {
-		if (json.length() < 1)
-			return;
-		LOG(INFO) << "json=" << json;
-		json2 doc;
-		try {
-			std::istringstream istr(json);
-			istr >> doc;
-		} catch (std::invalid_argument &iae) {
-			LOG(WARNING) << "parse exception:" << iae.what();
-			return;
-		} catch (std::exception &ex) {
-			LOG(WARNING) << "unknown exception parsing:" << ex.what();
-		}
-		JsonCommand command(doc);
+		std::istringstream istr(json);
+		istr >> doc;
+	} catch (std::invalid_argument &iae) {
+		LOG(WARNING) << "parse exception:" << iae.what();
+		return;
+	} catch (std::exception &ex) {
+		LOG(WARNING) << "unknown exception parsing:" << ex.what();
+		return;
+	}
+	handleJsonDocument(std::move(doc));
+}
+
+void
+RC2::RSession::handleJsonDocument(json2 doc)
+{
+	try {
+		JsonCommand command(std::move(doc));
 		if (command.type() == CommandType::Open) {
 			if (_impl->open) {
 				LOG(WARNING) << "duplicate open message received";
@@ -436,6 +680,7 @@ RC2::RSession::handleOpenCommand(JsonCommand &cmd)
 		return;
 	}
 	_impl->wspaceId = cmd.raw()["wspaceId"];
+	_impl->binaryVariables = cmd.raw().value("binaryVariables", false);
 	try {
 		_impl->sessionRecId = cmd.raw()["sessionRecId"];
 		string dbhost(cmd.valueForKey("dbhost"));
@@ -463,24 +708,38 @@ RC2::RSession::handleOpenCommand(JsonCommand &cmd)
 //		_impl->fileManager->setWorkingDir(workDir);
 		auto connection = make_shared<PGDBConnection>();
 		connection->connect(connectString.str());
+		_impl->fileManager->setFileCacheDir(_impl->fileCacheDir, (uint64_t)_impl->fileCacheMB * 1024 * 1024);
 		_impl->fileManager->initFileManager(workDir, connection, _impl->wspaceId, _impl->sessionRecId);
-		bool haveRData = _impl->fileManager->loadRData();
+		_impl->fileManager->setWorkspaceCodec(_impl->workspaceCodec);
+		try {
+			_impl->fileManager->startIOThread(connectString.str());
+		} catch (std::runtime_error &err) {
+			LOG(WARNING) << "file uploads will block, failed to start io thread: " << err.what();
+		}
 		setenv("TMPDIR", workDir.c_str(), 1);
 		setenv("TEMP", workDir.c_str(), 1);
 		setenv("R_DEFAULT_DEVICE", "png", 1);
 		_impl->R->parseEvalQNT("setwd(\"" + escape_quotes(workDir) + "\")");
 		_impl->ignoreOutput = true;
-		_impl->R->parseEvalQNT("library(rc2)");
-		_impl->R->parseEvalQNT("library(rmarkdown)");
-		_impl->R->parseEvalQNT("library(tools)");
+		preloadPackages();
 		_impl->R->parseEvalQNT("rm(argv)"); //RInside creates this even though we passed NULL
 		_impl->R->parseEvalQNT("options(device = \"rc2.pngdev\", bitmapType = \"cairo\")");
-		if (haveRData) {
+		if (_impl->restoreCheckpoint()) {
+			LOG(INFO) << "restored checkpoint";
+		} else if (_impl->fileManager->loadRData()) {
 			LOG(INFO) << "loading .RData";
 			_impl->R->parseEvalQNT("load(\".RData\")");
 		}
+		if (_impl->checkpointer && _impl->checkpointIntervalSecs > 0) {
+			_impl->checkpointEvent = event_new(_impl->eventBase, -1, EV_PERSIST, 
+				Impl::handleCheckpointTimer, _impl.get());
+			event_priority_set(_impl->checkpointEvent, 3); //only when nothing else is pending
+			struct timeval interval = {_impl->checkpointIntervalSecs, 0};
+			event_add(_impl->checkpointEvent, &interval);
+		}
 		_impl->ignoreOutput = false;
-		json2 response =  { {"msg", "openresponse"}, {"success", true} };
+		json2 response =  { {"msg", "openresponse"}, {"success", true}, 
+			{"binaryVariables", _impl->binaryVariables} };
 		sendJsonToClientSource(response.dump());
 		_impl->open = true;
 	} catch (std::runtime_error &err) {
@@ -497,7 +756,11 @@ RC2::RSession::handleCloseCommand()
 		return;
 	}
 	_impl->properlyClosed = true;
-	handleSaveEnvCommand();
+	if (_impl->checkpointEvent != nullptr)
+		event_del(_impl->checkpointEvent);
+	if (!_impl->checkpoint(true))
+		handleSaveEnvCommand();
+	_impl->fileManager->flushPendingChanges();
 	event_base_loopbreak(_impl->eventBase);
 }
 
@@ -506,8 +769,14 @@ RC2::RSession::handleSaveEnvCommand()
 {
 	LOG(INFO) << "saving .RData" << std::endl;
 //	BooleanWatcher watch(&_impl->ignoreOutput);
-	_impl->R->parseEvalQNT("save.image()");
+	//compressing in R is much slower than the codec, but is all there is without chunks
+	if (_impl->fileManager->compressesRData())
+		_impl->R->parseEvalQNT("save.image(compress = FALSE)");
+	else
+		_impl->R->parseEvalQNT("save.image()");
 	_impl->fileManager->saveRData();
+	if (_impl->checkpointer)
+		_impl->checkpointer->invalidate(); //saveRData() removed it
 }
 
 void
@@ -519,6 +788,7 @@ RC2::RSession::handleExecuteScript(JsonCommand& command) {
 		_impl->envWatcher->captureEnvironment();
 	}
 	_impl->fileManager->resetWatch();
+	_impl->fileManager->prefetchReferencedFiles(command.argument());
 	SEXP ans=NULL;
 	RInside::ParseEvalResult result = _impl->R->parseEvalR(command.argument(), ans);
 	LOG(INFO) << "parseEvalR returned " << (ans != NULL);
@@ -537,12 +807,12 @@ RC2::RSession::handleExecuteScript(JsonCommand& command) {
 void
 RC2::RSession::handleListVariablesCommand(bool delta, JsonCommand& command)
 {
-	json2 vars = delta ? _impl->envWatcher->jsonDelta() : _impl->envWatcher->toJson();
 	json2 results = {
-		{"variables", vars},
 		{"msg", "variableupdate"},
 		{"delta", delta}
 	};
+	//assign so the (possibly large) variable tree is moved rather than copied
+	results["variables"] = delta ? _impl->envWatcher->jsonDelta() : _impl->envWatcher->toJson();
 	if (!command.clientData().is_null())
 		results["clientData"] = command.clientData();
 	sendJsonToClientSource(results.dump());
@@ -551,12 +821,40 @@ RC2::RSession::handleListVariablesCommand(bool delta, JsonCommand& command)
 void
 RC2::RSession::handleGetVariableCommand(JsonCommand &command)
 {
-	json2 value = _impl->envWatcher->toJson(command.argument());
 	LOG(INFO) << "get variable:" <<command.argument();
 	json2 results = {
 		{"msg", "variablevalue"},
 		{"name", command.argument()},
-		{"value", value},
+		{"startTime", command.startTimeStr()}
+	};
+	json2 raw = command.raw();
+	VariableWindow window(raw.value("offset", 0), raw.value("limit", -1), 
+		raw.value("colOffset", 0), raw.value("colLimit", -1));
+	bool includeSummary = raw.value("summary", true);
+	if (!_impl->binaryVariables) {
+		results["value"] = _impl->envWatcher->toJson(command.argument(), window);
+		if (includeSummary)
+			results["value"]["summary"] = _impl->envWatcher->summary(command.argument());
+		sendJsonToClientSource(results.dump());
+		return;
+	}
+	vector<RObject> columns;
+	results["value"] = _impl->envWatcher->toJson(command.argument(), columns, window);
+	if (includeSummary)
+		results["value"]["summary"] = _impl->envWatcher->summary(command.argument());
+	results["binaryFrame"] = !columns.empty();
+	sendJsonToClientSource(results.dump());
+	if (!columns.empty())
+		sendBinaryColumnsToClient(columns);
+}
+
+void
+RC2::RSession::handleGetSummaryCommand(JsonCommand &command)
+{
+	json2 results = {
+		{"msg", "variablesummary"},
+		{"name", command.argument()},
+		{"summary", _impl->envWatcher->summary(command.argument())},
 		{"startTime", command.startTimeStr()}
 	};
 	sendJsonToClientSource(results.dump());
@@ -598,6 +896,9 @@ RC2::RSession::executeFile(JsonCommand& command) {
 		return;
 	}
 	fs::path p(fpath);
+	fs::path fullPath = fs::path(getWorkingDirectory()) / p;
+	if (fs::exists(fullPath))
+		_impl->fileManager->prefetchReferencedFiles(SlurpFile(fullPath.c_str()));
 	clearFileChanges();
 	_impl->fileManager->resetWatch();
 	if (_impl->watchVariables)
@@ -789,6 +1090,18 @@ RC2::RSession::sendOutputBufferToClient(bool is_error)
 		sendTextToClient(*_impl->consoleOutBuffer.get(), is_error);
 		_impl->consoleOutBuffer.get()->clear();
 	}
+	_impl->consoleLastWrite = currentFractionalSeconds();
+}
+
+//writes whatever is queued for the client without waiting for the event loop,
+// which does not run while R is evaluating
+void
+RC2::RSession::pushOutputToSocket()
+{
+	if (_impl->eventBuffer == nullptr)
+		return;
+	bufferevent_write_buffer(_impl->eventBuffer, _impl->outBuffer);
+	evbuffer_write(bufferevent_get_output(_impl->eventBuffer), _impl->socket);
 }
 
 //sends raw text (such has R console output or hard-coded string) packaged as json
@@ -796,10 +1109,11 @@ void
 RC2::RSession::sendTextToClient(string text, bool is_error)
 {
 	string msg = formatStringAsJson(text, is_error);
-	sendJsonToClientSource(msg);
+	sendJsonToClientSource(std::move(msg));
 }
 
-//packages json as bytes and sends over socket
+//packages json as bytes and queues it for the socket. The body is handed to the
+// evbuffer by reference, not copied, and the write happens once per loop turn
 // subclasses can override (i.e. testing) to avoid socket use
 void
 RC2::RSession::sendJsonToClientSource(string json)
@@ -807,21 +1121,37 @@ RC2::RSession::sendJsonToClientSource(string json)
 	if (json.length() < 1)
 		return;
 	if (_impl->socket > 0) { //only send if we have a valid socket
-		LOG(INFO) << "sending:" << json << "(" << json.length() << " bytes)";
 		int32_t header[2];
-		header[0] = kRSessionMagicNumber;
-		header[1] = json.length();
-		header[0] = htonl(header[0]);
-		header[1] = htonl(header[1]);
+		header[0] = htonl(kRSessionMagicNumber);
+		header[1] = htonl(json.length());
 		evbuffer_add(_impl->outBuffer, &header, sizeof(header));
-		evbuffer_add(_impl->outBuffer, json.c_str(), json.length());
-		
-		bufferevent_write_buffer(_impl->eventBuffer, _impl->outBuffer);
+		string *body = new string(std::move(json));
+		evbuffer_add_reference(_impl->outBuffer, body->data(), body->length(), 
+			RC2::RSession::Impl::releaseOutputString, body);
+		if (!_impl->flushScheduled) {
+			_impl->flushScheduled = true;
+			event_active(_impl->flushEvent, EV_TIMEOUT, 0);
+		}
 	} else {
 		LOG(WARNING) << "output w/o client:" << json;
 	}
 }
 
+//sends a binary frame immediately after the json that references it
+void
+RC2::RSession::sendBinaryColumnsToClient(vector<RObject>& columns)
+{
+	if (_impl->socket <= 0) {
+		LOG(WARNING) << "binary output w/o client: " << columns.size() << " columns";
+		return;
+	}
+	AppendBinaryColumnFrame(_impl->outBuffer, columns);
+	if (!_impl->flushScheduled) {
+		_impl->flushScheduled = true;
+		event_active(_impl->flushEvent, EV_TIMEOUT, 0);
+	}
+}
+
 string
 RC2::RSession::formatStringAsJson(const string &input, bool is_error)
 {
@@ -836,7 +1166,8 @@ RC2::RSession::formatStringAsJson(const string &input, bool is_error)
 	json2 response = {
 		{"msg", "results"},
 		{"string", output},
-		{is_error ? "stderr" : "stdout", true}
+		{is_error ? "stderr" : "stdout", true},
+		{"seq", _impl->outputSequence++}
 	};
 	if (_impl->currentQueryId > 0)
 		response["queryId"] = _impl->currentQueryId;
@@ -4,6 +4,7 @@
 #include <memory>
 #include <stdint.h>
 #include <functional>
+#include <vector>
 #include <boost/noncopyable.hpp>
 #include "JsonCommand.hpp"
 #include "SessionCommon.hpp"
@@ -37,6 +38,13 @@ namespace RC2 {
 			virtual ~RSession();
 			
 			bool 	parseArguments(int argc, char *argv[]);
+			//attaches the packages every session needs. safe to call more than once
+			void	preloadPackages();
+			//when started as part of rserver's warm pool, loads packages, signals ready
+			// and blocks until handed a client socket. As a zygote, loads packages and then
+			// forks a child for every client socket received; only the children return.
+			// returns false if no client socket could be obtained. Called before logging starts.
+			bool	awaitClientConnection();
 			void	prepareForRunLoop();
 			void	installExitHandler(void(*)(short flags));
 			virtual void	startEventLoop();
@@ -49,6 +57,7 @@ namespace RC2 {
 
 			//unit test subclasses might override
 			virtual void	sendJsonToClientSource(string json);
+			virtual void	sendBinaryColumnsToClient(std::vector<Rcpp::RObject>& columns);
 
 		protected:
 			void	consoleCallback(const string &text, bool is_error);
@@ -56,8 +65,10 @@ namespace RC2 {
 			void	clearFileChanges();
 			void	flushOutputBuffer();
 			void	sendOutputBufferToClient(bool is_error);
+			void	pushOutputToSocket();
 			void	sendTextToClient(string text, bool is_error=false);
 			void	handleJsonCommand(string json);
+			void	handleJsonDocument(json2 doc);
 			void	handleCommand(JsonCommand& command);
 			void	handleOpenCommand(JsonCommand& command);
 			void	handleCloseCommand();
@@ -65,6 +76,8 @@ namespace RC2 {
 			void	handleHelpCommand(JsonCommand& command);
 			void	handleListVariablesCommand(bool delta, JsonCommand& command);
 			void	handleGetVariableCommand(JsonCommand& command);
+			void	handleGetSummaryCommand(JsonCommand& command);
+			bool	forkForClients();
 
 			void	handleExecuteScript(JsonCommand& command);
 			void	executeFile(JsonCommand& command);
@@ -0,0 +1,89 @@
+#include <cstring>
+#include <set>
+#include "RC2Logging.h"
+#include "../common/FormattedException.hpp"
+#include "WorkspaceCheckpointer.hpp"
+
+using namespace std;
+
+static uint64_t
+hashBytes(const unsigned char *bytes, size_t length) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i=0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+RC2::WorkspaceCheckpointer::WorkspaceCheckpointer(SEXP environ)
+	: _env(environ), _generation(0), _confirmed(false)
+{
+}
+
+long
+RC2::WorkspaceCheckpointer::collectChanges(vector<CheckpointVariable> &changed, 
+	vector<string> &removed, bool &replace)
+{
+	Rcpp::Function serialize("serialize");
+	replace = !_confirmed;
+	Rcpp::StringVector names(_env.ls(true)); //save.image() includes hidden variables
+	//only kept if every variable serializes, so a failed checkpoint is sent again in full
+	map<string, Entry> entries(_entries);
+	set<string> current;
+	for (int i=0; i < names.size(); i++) {
+		string name = Rcpp::as<string>(names[i]);
+		current.insert(name);
+		Rcpp::RObject value(_env.get(name));
+		VariableIdentity identity(value, true);
+		auto itr = entries.find(name);
+		bool known = itr != entries.end();
+		if (known && !replace && identity.complete && itr->second.identity == identity)
+			continue;
+		Rcpp::RawVector raw;
+		try {
+			raw = serialize(value, R_NilValue);
+		} catch (std::exception &e) {
+			throw FormattedException("failed to serialize %s for checkpoint: %s", name.c_str(), e.what());
+		}
+		uint64_t hash = hashBytes(raw.begin(), raw.size());
+		bool same = known && itr->second.hash == hash;
+		entries[name] = Entry{identity, hash};
+		if (!same || replace)
+			changed.push_back(CheckpointVariable{name, hash, string((char*)raw.begin(), raw.size())});
+	}
+	for (auto itr = entries.begin(); itr != entries.end(); ) {
+		if (current.count(itr->first) > 0) {
+			++itr;
+			continue;
+		}
+		removed.push_back(itr->first);
+		itr = entries.erase(itr);
+	}
+	_entries.swap(entries);
+	_confirmed = false;
+	return ++_generation;
+}
+
+//an older checkpoint finishing doesn't mean a newer one did
+void
+RC2::WorkspaceCheckpointer::confirm(long generation)
+{
+	if (generation == _generation)
+		_confirmed = true;
+}
+
+void
+RC2::WorkspaceCheckpointer::restore(const CheckpointVariable &var)
+{
+	Rcpp::Function unserialize("unserialize");
+	Rcpp::RawVector raw(var.data.length());
+	memcpy(raw.begin(), var.data.data(), var.data.length());
+	try {
+		Rcpp::RObject value(unserialize(raw));
+		_env.assign(var.name, value);
+		_entries[var.name] = Entry{VariableIdentity(value, true), var.hash};
+	} catch (std::exception &e) {
+		LOG(WARNING) << "failed to restore " << var.name << " from checkpoint: " << e.what();
+	}
+}
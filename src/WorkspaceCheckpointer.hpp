@@ -0,0 +1,50 @@
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#define STRICT_R_HEADERS
+#include <Rcpp.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "EnvironmentWatcher.hpp"
+#include "FileManager.hpp"
+
+namespace RC2 {
+
+//Tracks what was last stored for each variable of an environment, so a checkpoint only has
+// to send the variables that changed. A checkpoint is a full replacement until the database
+// has confirmed the previous one.
+class WorkspaceCheckpointer : private boost::noncopyable {
+public:
+	explicit WorkspaceCheckpointer(SEXP environ);
+
+	//serializes the variables whose full identity changed since the last checkpoint, and
+	// those that can't be fully digested. Only ones whose serialized hash differs are put in
+	// changed. If replace is set, changed has every variable and the stored checkpoint should
+	// be discarded first. Returns the generation to pass to confirm(). Throws if a variable
+	// can't be serialized, without changing what is tracked
+	long collectChanges(std::vector<CheckpointVariable> &changed, 
+						std::vector<std::string> &removed, bool &replace);
+	//the checkpoint from collectChanges() was stored
+	void confirm(long generation);
+	//assigns a variable from a stored checkpoint
+	void restore(const CheckpointVariable &var);
+	//call after all variables have been restored
+	void restoreComplete() { confirm(_generation); }
+	//the stored checkpoint was discarded, so the next one must replace it
+	void invalidate() { _confirmed = false; }
+
+protected:
+	//values aren't held, since that would make every subassignment copy them. A complete
+	// identity is enough to tell if a value changed
+	struct Entry {
+		VariableIdentity identity;
+		uint64_t hash;
+	};
+	Rcpp::Environment _env;
+	std::map<std::string, Entry> _entries;
+	long _generation;
+	bool _confirmed;
+};
+
+} //namespace RC2
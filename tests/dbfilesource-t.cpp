@@ -2,9 +2,13 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <iterator>
+#include <map>
 #include <memory>
 #include "../src/RC2Logging.h"
 #include "../src/DBFileSource.hpp"
+#include "../src/FileCache.hpp"
+#include <sys/stat.h>
 #include "common/RC2Utils.hpp"
 #define BOOST_NO_CXX11_SCOPED_ENUMS
 #include <boost/filesystem.hpp>
@@ -39,6 +43,8 @@ namespace testing {
 		virtual void TearDown() {
 			//nuke the fake .RData we created
 			db->executeQuery("delete from rcworkspacedata where id = 1");
+			db->executeQuery("delete from rcworkspacedatachunk where wspaceid = 1");
+			db->executeQuery("delete from rcworkspacevar where wspaceid = 1");
 			db = nullptr;
 		}
 	};
@@ -66,4 +72,123 @@ namespace testing {
 		ASSERT_EQ(data, text);
 	}
 
+	TEST_F(DBSourceTest, loadMultiChunkRData)
+	{
+		//spans several chunks, with a partial one at the end
+		string data;
+		for (int i=0; data.length() < 2600 * 1024; i++)
+			data += to_string(i) + '\0';
+		fs::path path = this->tmpDir.getPath();
+		path += "/.RData";
+		ofstream ofs(path.c_str(), ios::binary);
+		ofs << data;
+		ofs.close();
+		
+		source.saveRData();
+		fs::remove(path);
+		ASSERT_TRUE(source.loadRData());
+		ASSERT_EQ(data.length(), fs::file_size(path));
+		
+		ifstream ifs(path.c_str(), ios::binary);
+		string loaded((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+		ASSERT_EQ(data, loaded);
+	}
+
+	TEST(FileCacheTest, privateDirectory)
+	{
+		RC2::TemporaryDirectory tmpDir;
+		struct stat sb;
+		string newDir = tmpDir.getPath() + "/new/cache";
+		RC2::FileCache cache(newDir);
+		ASSERT_EQ(stat(newDir.c_str(), &sb), 0);
+		ASSERT_EQ(sb.st_mode & 0777, 0700);
+		string srcPath = tmpDir.getPath() + "/src.R";
+		ofstream(srcPath) << "x <- 1" << endl;
+		cache.add(RC2::FileCacheKey(5, 1), srcPath);
+		string destPath = tmpDir.getPath() + "/dest.R";
+		ASSERT_TRUE(cache.copyTo(RC2::FileCacheKey(5, 1), destPath));
+		ASSERT_EQ(RC2::SlurpFile(destPath.c_str()), "x <- 1\n");
+		ASSERT_FALSE(cache.copyTo(RC2::FileCacheKey(5, 2), destPath));
+		//a directory anyone could write to is locked down and anything planted is removed
+		string openDir = tmpDir.getPath() + "/open";
+		mkdir(openDir.c_str(), 0700);
+		chmod(openDir.c_str(), 0777);
+		ofstream(openDir + "/1-1") << "ours";
+		symlink("/etc/passwd", (openDir + "/2-1").c_str());
+		RC2::FileCache openCache(openDir);
+		ASSERT_EQ(stat(openDir.c_str(), &sb), 0);
+		ASSERT_EQ(sb.st_mode & 0777, 0700);
+		ASSERT_TRUE(fs::exists(openDir + "/1-1"));
+		ASSERT_FALSE(fs::is_symlink(openDir + "/2-1"));
+		//not a directory
+		ASSERT_THROW({ RC2::FileCache fileCache(srcPath); }, std::exception);
+	}
+
+	TEST_F(DBSourceTest, blobCodec)
+	{
+		string data(100000, 'a');
+		string encoded = RC2::EncodeBlob(RC2::BlobCodec::Zlib, data.data(), data.length());
+		ASSERT_LT(encoded.length(), data.length());
+		ASSERT_EQ(data, RC2::DecodeBlob(encoded.data(), encoded.length()));
+		//data stored before codecs existed
+		ASSERT_EQ(data, RC2::DecodeBlob(data.data(), data.length()));
+		//uncompressed data that looks like a header still has its own
+		string lookalike = RC2::EncodeBlob(RC2::BlobCodec::Zlib, data.data(), data.length());
+		string plain = RC2::EncodeBlob(RC2::BlobCodec::None, lookalike.data(), lookalike.length());
+		ASSERT_GT(plain.length(), lookalike.length());
+		ASSERT_EQ(lookalike, RC2::DecodeBlob(plain.data(), plain.length()));
+	}
+
+	TEST_F(DBSourceTest, compressedRData)
+	{
+		source.setCodec(RC2::BlobCodec::Zlib);
+		string data;
+		for (int i=0; data.length() < 1500 * 1024; i++)
+			data += to_string(i) + '\n';
+		fs::path path = this->tmpDir.getPath();
+		path += "/.RData";
+		ofstream ofs(path.c_str(), ios::binary);
+		ofs << data;
+		ofs.close();
+		
+		source.saveRData();
+		fs::remove(path);
+		ASSERT_TRUE(source.loadRData());
+		ifstream ifs(path.c_str(), ios::binary);
+		string loaded((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+		ASSERT_EQ(data, loaded);
+	}
+
+	TEST_F(DBSourceTest, checkpoint)
+	{
+		if (!source.checkpointAvailable())
+			return; //database predates checkpoints
+		map<string, string> loaded;
+		auto handler = [&loaded](const RC2::CheckpointVariable &var) { loaded[var.name] = var.data; };
+		ASSERT_FALSE(source.loadCheckpoint(handler));
+		
+		vector<RC2::CheckpointVariable> vars = { {"x", 1, string("a\0b", 3)}, {"y", 2, "yy"} };
+		source.saveCheckpoint(*db, vars, vector<string>(), true);
+		vector<RC2::CheckpointVariable> changed = { {"x", 3, "xx"} };
+		source.saveCheckpoint(*db, changed, vector<string>{"y"}, false);
+		ASSERT_TRUE(source.loadCheckpoint(handler));
+		ASSERT_EQ(1, loaded.size());
+		ASSERT_EQ("xx", loaded["x"]);
+		
+		//an empty checkpoint still exists
+		loaded.clear();
+		source.saveCheckpoint(*db, vector<RC2::CheckpointVariable>(), vector<string>(), true);
+		ASSERT_TRUE(source.loadCheckpoint(handler));
+		ASSERT_EQ(0, loaded.size());
+		
+		//a full save makes it obsolete
+		fs::path path = this->tmpDir.getPath();
+		path += "/.RData";
+		ofstream ofs(path.c_str());
+		ofs << "foo";
+		ofs.close();
+		source.saveRData();
+		ASSERT_FALSE(source.loadCheckpoint(handler));
+	}
+
 };
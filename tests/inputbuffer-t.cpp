@@ -24,6 +24,16 @@ namespace testing {
 		evbuffer_add(buffer, json.c_str(), json.length());
 	}
 
+	void
+	appendFrame(evbuffer *buffer, string json)
+	{
+		uint32_t val = htonl(kRSessionMagicNumber);
+		evbuffer_add(buffer, &val, sizeof(val));
+		val = htonl(json.length());
+		evbuffer_add(buffer, &val, sizeof(val));
+		evbuffer_add(buffer, json.c_str(), json.length());
+	}
+
 	TEST(InputBufferTest, singleInputTest)
 	{
 		InputBufferManager ib;
@@ -33,23 +43,42 @@ namespace testing {
 		ib.appendData(buffer);
 		
 		ASSERT_TRUE(ib.hasCompleteMessage());
-		ASSERT_STREQ(json.c_str(), ib.popCurrentMessage().c_str());
+		ASSERT_EQ(json2::parse(json), ib.popCurrentMessage());
+		ASSERT_FALSE(ib.hasCompleteMessage());
 	}
 
-	TEST(InputBufferTest, doubleInputTest)
+	TEST(InputBufferTest, pipelinedInputTest)
 	{
 		InputBufferManager ib;
 		evbuffer *buffer = evbuffer_new();
-		string json = "{ \"a\":22, \"name\":\"foo\",";
-		string json2 = "\"b\":11, \"stype\":\"bar\"}";
+		string json = "{ \"a\":22, \"name\":\"foo\"}";
+		string otherJson = "{\"b\":11, \"stype\":\"bar\"}";
 		setBufferToJson(buffer, json);
+		appendFrame(buffer, otherJson);
 		ib.appendData(buffer);
-		setBufferToJson(buffer, json2);
+		
+		ASSERT_TRUE(ib.hasCompleteMessage());
+		ASSERT_EQ(json2::parse(json), ib.popCurrentMessage());
+		ASSERT_TRUE(ib.hasCompleteMessage());
+		ASSERT_EQ(json2::parse(otherJson), ib.popCurrentMessage());
+		ASSERT_FALSE(ib.hasCompleteMessage());
+	}
+
+	TEST(InputBufferTest, splitInputTest)
+	{
+		InputBufferManager ib;
+		evbuffer *buffer = evbuffer_new();
+		string json = "{ \"a\":22, \"name\":\"foo\"}";
+		evbuffer *whole = evbuffer_new();
+		setBufferToJson(whole, json);
+		size_t half = evbuffer_get_length(whole) / 2;
+		evbuffer_remove_buffer(whole, buffer, half);
 		ib.appendData(buffer);
+		ASSERT_FALSE(ib.hasCompleteMessage());
 		
-		json += json2;
+		ib.appendData(whole);
 		ASSERT_TRUE(ib.hasCompleteMessage());
-		ASSERT_STREQ(json.c_str(), ib.popCurrentMessage().c_str());
+		ASSERT_EQ(json2::parse(json), ib.popCurrentMessage());
 	}
 
 	TEST(InputBufferTest, ignoreBadExtraDataTest)
@@ -57,19 +86,34 @@ namespace testing {
 		InputBufferManager ib;
 		evbuffer *buffer = evbuffer_new();
 		string json = "{ \"a\":22, \"name\":\"foo\"}";
-		string json2 = "{\"b\":11, \"stype\":\"bar\"}";
+		string otherJson = "{\"b\":11, \"stype\":\"bar\"}";
 		char junk[4] = {'A','Z',2,11};
 		setBufferToJson(buffer, json);
 		evbuffer_add(buffer, &junk, sizeof(junk));
 		ib.appendData(buffer);
 		
 		ASSERT_TRUE(ib.hasCompleteMessage());
-		ASSERT_STREQ(json.c_str(), ib.popCurrentMessage().c_str());
+		ASSERT_EQ(json2::parse(json), ib.popCurrentMessage());
 
-		setBufferToJson(buffer, json2);
+		setBufferToJson(buffer, otherJson);
 		ib.appendData(buffer);
 		ASSERT_TRUE(ib.hasCompleteMessage());
-		ASSERT_STREQ(json2.c_str(), ib.popCurrentMessage().c_str());
+		ASSERT_EQ(json2::parse(otherJson), ib.popCurrentMessage());
+	}
+
+	TEST(InputBufferTest, oversizedFrameTest)
+	{
+		InputBufferManager ib(16);
+		evbuffer *buffer = evbuffer_new();
+		string bigJson = "{\"name\":\"much too long for the limit\"}";
+		string json = "{\"a\":22}";
+		setBufferToJson(buffer, bigJson);
+		appendFrame(buffer, json);
+		ib.appendData(buffer);
+		
+		ASSERT_TRUE(ib.hasCompleteMessage());
+		ASSERT_EQ(json2::parse(json), ib.popCurrentMessage());
+		ASSERT_FALSE(ib.hasCompleteMessage());
 	}
 
 };
@@ -5,6 +5,9 @@
 #include "../src/RC2Logging.h"
 #include "testlib/TestPGDBConnection.hpp"
 #include "testlib/TestingSession.hpp"
+#include "../src/IOWorker.hpp"
+#include "common/SequenceAllocator.hpp"
+#include <thread>
 
 using namespace std;
 
@@ -40,6 +43,99 @@ namespace testing {
 		ASSERT_EQ(payload, "foo");
 	}
 	
+	TEST_F(PGDBConnectionTest, preparedQueries) {
+		static const RC2::PreparedQuery addStmt = {"test_add", "select $1::int4 + $2::int4", 2};
+		const char *params[] = {"2", "3"};
+		ASSERT_EQ(db->longFromPrepared(addStmt, params), 5);
+		//second use runs the existing statement
+		const char *params2[] = {"4", "5"};
+		DBResult res = db->executePrepared(addStmt, params2, NULL, NULL, 0);
+		ASSERT_TRUE(res.dataReturned());
+		ASSERT_STREQ(res.getValue(0, 0), "9");
+		static const RC2::PreparedQuery badStmt = {"test_bad", "select bad syntax", 0};
+		ASSERT_THROW(db->longFromPrepared(badStmt), DBException);
+	}
+	
+	TEST_F(PGDBConnectionTest, pipeline) {
+		static const RC2::PreparedQuery echoStmt = {"test_echo", "select $1::text", 1};
+		static const RC2::PreparedQuery failStmt = {"test_fail", "select 1/0", 0};
+		const char *first[] = {"first"}, *second[] = {"second"};
+		vector<DBResult> results = db->executePipeline({{&echoStmt, first, NULL, NULL}, 
+			{&echoStmt, second, NULL, NULL}});
+		ASSERT_EQ(results.size(), 2);
+		ASSERT_STREQ(results[0].getValue(0, 0), "first");
+		ASSERT_STREQ(results[1].getValue(0, 0), "second");
+		//statements after a failure are skipped
+		results = db->executePipeline({{&failStmt, NULL, NULL, NULL}, {&echoStmt, first, NULL, NULL}});
+		ASSERT_FALSE(results[0].dataReturned());
+		ASSERT_FALSE(results[1].dataReturned());
+		ASSERT_EQ(db->longFromQuery("select 1"), 1);
+	}
+	
+	TEST_F(PGDBConnectionTest, sequenceAllocator) {
+		db->executeQuery("create temporary sequence test_alloc_seq");
+		RC2::SequenceAllocator allocator("test_alloc_seq", 3);
+		vector<long> ids;
+		for (int i=0; i < 4; i++)
+			ids.push_back(allocator.next(*db));
+		ASSERT_EQ(ids, vector<long>({1, 2, 3, 4}));
+		//two blocks were reserved
+		ASSERT_EQ(db->longFromQuery("select last_value from test_alloc_seq"), 6);
+	}
+	
+	TEST_F(PGDBConnectionTest, asyncQueries) {
+		event_base *eb = event_base_new();
+		db->setEventBase(eb);
+		vector<string> results;
+		db->sendQuery("select $1::text", {"first"}, {}, [&results](DBResult &res) {
+			results.push_back(res.getValue(0, 0));
+		}, 0);
+		db->sendQuery("select $1::bytea", {string("a\0b", 3)}, {1}, [&results](DBResult &res) {
+			results.push_back(string(res.getValue(0, 0), res.getLength(0, 0)));
+		});
+		ASSERT_TRUE(db->asyncPending());
+		while (db->asyncPending())
+			event_base_loop(eb, EVLOOP_ONCE);
+		ASSERT_EQ(results, vector<string>({"first", string("a\0b", 3)}));
+		//blocking calls wait for queries already sent
+		db->sendQuery("select bad syntax", {}, {}, [&results](DBResult &res) {
+			results.push_back(res.dataReturned() ? "rows" : "error");
+		});
+		ASSERT_EQ(db->longFromQuery("select 1"), 1);
+		ASSERT_EQ(results.back(), "error");
+		db->setEventBase(nullptr);
+		event_base_free(eb);
+	}
+	
+	TEST_F(PGDBConnectionTest, ioWorker) {
+		event_base *eb = event_base_new();
+		auto workerDb = make_shared<RC2::TestPGDBConnection>();
+		workerDb->connect("");
+		vector<long> results;
+		bool completed = false, failedCompleted = false;
+		{
+			RC2::IOWorker worker(eb, workerDb);
+			auto mainThread = this_thread::get_id();
+			for (long i=1; i <= 3; ++i) {
+				worker.post([i, &results, mainThread](RC2::PGDBConnection &con) {
+					ASSERT_NE(this_thread::get_id(), mainThread);
+					results.push_back(con.longFromQuery("select " + to_string(i)));
+				});
+			}
+			worker.post([](RC2::PGDBConnection &con) { throw runtime_error("failed job"); },
+				[&failedCompleted]() { failedCompleted = true; });
+			worker.post([](RC2::PGDBConnection &con) {}, [&completed, mainThread]() {
+				ASSERT_EQ(this_thread::get_id(), mainThread);
+				completed = true;
+			});
+			worker.drain();
+			ASSERT_TRUE(worker.idle());
+		}
+		ASSERT_EQ(results, vector<long>({1, 2, 3}));
+		ASSERT_TRUE(completed);
+		ASSERT_FALSE(failedCompleted);
+		event_base_free(eb);
+	}
 
 	shared_ptr<RC2::TestPGDBConnection> PGDBConnectionTest::db;
 //	TestLogging PGDBConnectionTest::testLogging;	
@@ -213,6 +213,7 @@ namespace testing {
 	RSessionCallbacks* BaseSessionTest::callbacks = nullptr;
 	TestingSession* BaseSessionTest::session = nullptr;
 	TestingFileManager* BaseSessionTest::fileManager = nullptr;
+	json BaseSessionTest::openResponse;
 //	unique_ptr<TestLogging> BaseSessionTest::testLogger(new TestLogging());
 	
 };
@@ -59,6 +59,9 @@ namespace RC2 {
 		
 		virtual bool	loadRData();
 		virtual void	saveRData();
+		virtual bool	checkpointAvailable() { return false; }
+		virtual void	setWorkspaceCodec(BlobCodec codec) {}
+		virtual bool	compressesRData() { return false; }
 		
 		virtual bool	filePathForId(long fileId, std::string& filePath);
 		virtual void	findOrAddFile(std::string fname, FileInfo &info);
@@ -96,6 +99,7 @@ namespace testing {
 		static RSessionCallbacks *callbacks;
 		static TestingSession *session;
 		static TestingFileManager *fileManager;
+		static json openResponse;
 //		static unique_ptr<TestLogging> testLogger;
 		
 		static void SetUpTestCase() {
@@ -114,6 +118,11 @@ namespace testing {
 			event_set_log_callback(myevent_logger);
 			session->prepareForRunLoop();
 			session->doJson("{\"msg\":\"open\", \"argument\": \"\", \"wspaceId\":1, \"sessionRecId\":1, \"dbhost\":\"localhost\", \"dbuser\":\"rc2\", \"dbname\":\"rc2test\", \"dbpass\":\"rc2\"}");
+			while (!session->_messages.empty()) {
+				json msg = session->popMessage();
+				if (msg["msg"] == "openresponse")
+					openResponse = msg;
+			}
 			cerr << "setup complete" << endl;
 //			fileManager->setWorkingDir(session->getWorkingDirectory());
 		}
@@ -3,11 +3,17 @@
 #include <string>
 #include <iostream>
 #include <queue>
+#include <set>
 #include <thread>
+#include <cstring>
+#include <arpa/inet.h>
+#include <event2/buffer.h>
 #include <Rcpp.h>
 #include "common/RC2Utils.hpp"
 #include "testlib/TestingSession.hpp"
 #include "src/EnvironmentWatcher.hpp"
+#include "src/BinaryVariableWriter.hpp"
+#include "src/WorkspaceCheckpointer.hpp"
 
 using json = nlohmann::json;
 using namespace std;
@@ -18,6 +24,79 @@ namespace testing {
 		virtual void pureVirtual() {}
 	};
 	
+	//exposes the json cache so a test can tell a cached listing from a fresh one
+	class CacheTestWatcher : public EnvironmentWatcher {
+	public:
+		using EnvironmentWatcher::EnvironmentWatcher;
+		bool isCached(std::string name) { return _valueCache.count(std::make_pair(name, true)) > 0; }
+		void markCached(std::string name) { _valueCache[std::make_pair(name, true)].serialized["fromCache"] = true; }
+	};
+	
+	//one column of a binary variable frame
+	struct BinaryColumn {
+		char type;
+		uint8_t flags;
+		uint32_t count;
+		string bitmap, data;
+		vector<uint32_t> offsets;
+		
+		bool isNA(uint32_t i) const { return !bitmap.empty() && ((bitmap[i / 8] >> (i % 8)) & 1); }
+		template<typename T> T value(uint32_t i) const { 
+			T val;
+			memcpy(&val, data.data() + i * sizeof(T), sizeof(T));
+			return val;
+		}
+		string stringValue(uint32_t i) const { return data.substr(offsets[i], offsets[i + 1] - offsets[i]); }
+	};
+	
+	//the names of the variables a checkpoint sends
+	set<string> checkpointNames(const vector<CheckpointVariable> &changed)
+	{
+		set<string> names;
+		for (auto &var : changed)
+			names.insert(var.name);
+		return names;
+	}
+	
+	//decodes the frame AppendBinaryColumnFrame wrote to buffer, without draining it
+	vector<BinaryColumn> readBinaryFrame(struct evbuffer *buffer)
+	{
+		string bytes(evbuffer_get_length(buffer), '\0');
+		evbuffer_copyout(buffer, &bytes[0], bytes.length());
+		uint32_t header[2];
+		memcpy(header, bytes.data(), sizeof(header));
+		EXPECT_EQ(ntohl(header[0]), kRSessionBinaryMagicNumber);
+		EXPECT_EQ(ntohl(header[1]), bytes.length() - sizeof(header));
+		size_t pos = sizeof(header);
+		uint32_t columnCount;
+		memcpy(&columnCount, &bytes[pos], sizeof(columnCount));
+		pos += sizeof(columnCount);
+		vector<BinaryColumn> columns(columnCount);
+		for (auto &col : columns) {
+			col.type = bytes[pos];
+			col.flags = bytes[pos + 1];
+			memcpy(&col.count, &bytes[pos + 4], sizeof(col.count));
+			pos += 8;
+			if (col.flags & 1) {
+				col.bitmap = bytes.substr(pos, (col.count + 7) / 8);
+				pos += col.bitmap.length();
+			}
+			if (col.count == 0)
+				continue;
+			size_t dataLength = col.count * (col.type == 'd' ? 8 : 4);
+			if (col.type == 's') {
+				col.offsets.resize(col.count + 1);
+				memcpy(col.offsets.data(), &bytes[pos], col.offsets.size() * sizeof(uint32_t));
+				pos += col.offsets.size() * sizeof(uint32_t);
+				dataLength = col.offsets[col.count];
+			}
+			col.data = bytes.substr(pos, dataLength);
+			pos += dataLength;
+		}
+		EXPECT_EQ(pos, bytes.length());
+		return columns;
+	}
+	
 	TEST_F(VarTest, getVariable)
 	{
 		session->doJson("{\"msg\":\"execScript\", \"argument\":\"testVar<-22\"}");
@@ -29,6 +108,18 @@ namespace testing {
 		ASSERT_TRUE(results["value"]["value"][0] == 22);
 	}
 
+	TEST_F(VarTest, getSummary)
+	{
+		session->doJson("{\"msg\":\"execScript\", \"argument\":\"sumVar<-list(a=1, b='x')\"}");
+		session->emptyMessages();
+		session->doJson("{\"msg\":\"getSummary\", \"argument\":\"sumVar\"}");
+		ASSERT_EQ(session->_messages.size(), 1);
+		json results = session->popMessage();
+		ASSERT_EQ(results["msg"], "variablesummary");
+		std::string summary = results["summary"];
+		ASSERT_EQ(summary.find("List of 2"), 0);
+	}
+
 	TEST_F(VarTest, listVariables)
 	{
 		session->doJson("{\"msg\":\"execScript\", \"argument\":\"rm(list=ls())\"}");
@@ -95,6 +186,21 @@ namespace testing {
 		//TODO: Date, POSIXlt, matrix, array, list, s3, s4
 	}
 	
+	TEST_F(VarTest, specialDoubles) {
+		EnvironmentWatcher watcher(Rcpp::Environment::global_env(), session->getExecCallback());
+		session->execScript("sd <- c(1, NA, NaN, Inf, -Inf)");
+		json sd = watcher.toJson("sd");
+		ASSERT_EQ(sd["value"][0], 1);
+		ASSERT_TRUE(sd["value"][1].is_null());
+		ASSERT_EQ(sd["value"][2], "NaN");
+		ASSERT_EQ(sd["value"][3], "Inf");
+		ASSERT_EQ(sd["value"][4], "-Inf");
+		session->execScript("sdf <- data.frame(d=c(NaN, NA))");
+		json sdf = watcher.toJson("sdf");
+		ASSERT_EQ(sdf["rows"][0][0], "NaN");
+		ASSERT_TRUE(sdf["rows"][1][0].is_null());
+	}
+	
 	TEST_F(VarTest, factorTest) {
 		EnvironmentWatcher watcher(Rcpp::Environment::global_env(),  session->getExecCallback());
 		session->execScript("f <- factor(c(1,1,3,4,2,5), labels = letters[1:5])");
@@ -131,6 +237,32 @@ namespace testing {
 		ASSERT_EQ(df["rows"][14][1], 164.0);
 	}
 
+	TEST_F(VarTest, windowTest) {
+		EnvironmentWatcher watcher(Rcpp::Environment::global_env(), session->getExecCallback());
+		session->execScript("df <- data.frame(n=1:500, s=as.character(1:500), stringsAsFactors=FALSE)");
+		json df = watcher.toJson("df", VariableWindow(200, 10, 1, 1));
+		ASSERT_EQ(df["nrow"], 500);
+		ASSERT_EQ(df["ncol"], 2);
+		ASSERT_EQ(df["window"]["offset"], 200);
+		ASSERT_EQ(df["window"]["count"], 10);
+		ASSERT_EQ(df["window"]["colOffset"], 1);
+		ASSERT_EQ(df["rows"].size(), 10);
+		ASSERT_EQ(df["rows"][0].size(), 1);
+		ASSERT_EQ(df["rows"][0][0], "201");
+		ASSERT_EQ(df["rows"][9][0], "210");
+		ASSERT_EQ(df["row.names"][0], "201");
+		session->execScript("v <- 1:1000");
+		json v = watcher.toJson("v", VariableWindow(990, 50));
+		ASSERT_EQ(v["length"], 1000);
+		ASSERT_EQ(v["value"].size(), 10);
+		ASSERT_EQ(v["value"][0], 991);
+		session->execScript("m <- matrix(1:12, nrow=3)");
+		json m = watcher.toJson("m", VariableWindow(1, 2, 2, 1));
+		ASSERT_EQ(m["value"].size(), 2);
+		ASSERT_EQ(m["value"][0], 8);
+		ASSERT_EQ(m["value"][1], 9);
+	}
+
 	TEST_F(VarTest, simpleDelta) {
 		EnvironmentWatcher watcher(Rcpp::Environment::global_env(),  session->getExecCallback());
 		session->execScript("x <- 2; y <- 4");
@@ -147,5 +279,192 @@ namespace testing {
 		ASSERT_EQ(delta["removed"].size(), 1);
 		ASSERT_EQ(delta["removed"][0], "y");
 	}
-};
 
+	TEST_F(VarTest, modifiedDelta) {
+		EnvironmentWatcher watcher(Rcpp::Environment::global_env(),  session->getExecCallback());
+		session->execScript("x <- c(1, 2, 3); y <- 4");
+		watcher.captureEnvironment();
+		session->execScript("x[2] <- 22");
+		json delta = watcher.jsonDelta();
+		ASSERT_EQ(delta["modified"].size(), 1);
+		ASSERT_EQ(delta["modified"][0], "x");
+		ASSERT_EQ(delta["assigned"].size(), 1);
+		ASSERT_EQ(delta["assigned"]["x"]["value"][1], 22);
+		watcher.captureEnvironment();
+		session->execScript("y <- y");
+		delta = watcher.jsonDelta();
+		ASSERT_EQ(delta["modified"].size(), 0);
+		ASSERT_EQ(delta["assigned"].size(), 0);
+	}
+
+	TEST_F(VarTest, valueCache) {
+		CacheTestWatcher watcher(Rcpp::Environment::global_env(), session->getExecCallback());
+		session->execScript("rm(list=ls())");
+		session->execScript("cf <- function(a, b = 2) { if (a > b) a else b + 1 }");
+		session->execScript("cdf <- data.frame(d=runif(100000), s=as.character(1:100000), stringsAsFactors=FALSE)");
+		session->execScript("cv <- runif(100000)");
+		watcher.toJson();
+		for (auto name : {"cf", "cdf", "cv"}) {
+			ASSERT_TRUE(watcher.isCached(name)) << name;
+			watcher.markCached(name);
+		}
+		json vars = watcher.toJson();
+		ASSERT_EQ(vars["cf"]["fromCache"], true);
+		ASSERT_EQ(vars["cdf"]["fromCache"], true);
+		ASSERT_EQ(vars["cv"]["fromCache"], true);
+		//changes outside the parts a sampled digest looks at. cv is changed in place
+		session->execScript("cv[30001] <- 0; cdf[[1]][30001] <- 0");
+		session->execScript("body(cf) <- quote(a - b)");
+		vars = watcher.toJson();
+		ASSERT_EQ(vars["cv"].count("fromCache"), 0);
+		ASSERT_EQ(vars["cdf"].count("fromCache"), 0);
+		ASSERT_EQ(vars["cf"].count("fromCache"), 0);
+		ASSERT_NE(vars["cf"]["body"].get<string>().find("a - b"), string::npos);
+		//a function with its own environment can change without being replaced
+		session->execScript("cf <- local({ n <- 1; function() n })");
+		vars = watcher.toJson();
+		ASSERT_FALSE(watcher.isCached("cf"));
+	}
+
+	TEST_F(VarTest, binaryNegotiation) {
+		//the test session doesn't ask for binary variables, so values stay json
+		ASSERT_EQ(openResponse["success"], true);
+		ASSERT_EQ(openResponse["binaryVariables"], false);
+		session->execScript("nv <- c(1, 2)");
+		session->emptyMessages();
+		session->doJson("{\"msg\":\"getVariable\", \"argument\":\"nv\"}");
+		ASSERT_EQ(session->_messages.size(), 1);
+		json results = session->popMessage();
+		ASSERT_EQ(results.count("binaryFrame"), 0);
+		ASSERT_EQ(results["value"]["value"][1], 2);
+	}
+
+	TEST_F(VarTest, binaryVectorFrame) {
+		EnvironmentWatcher watcher(Rcpp::Environment::global_env(), session->getExecCallback());
+		session->execScript("bv <- c(1.5, NA, 3, NaN)");
+		vector<RObject> columns;
+		json bv = watcher.toJson("bv", columns);
+		ASSERT_EQ(bv["binaryColumn"], 0);
+		ASSERT_EQ(bv.count("value"), 0);
+		ASSERT_EQ(columns.size(), 1);
+		struct evbuffer *buffer = evbuffer_new();
+		AppendBinaryColumnFrame(buffer, columns);
+		columns.clear();
+		//the frame references the vector, so changing it must not change what is sent
+		session->execScript("bv[1] <- 99");
+		vector<BinaryColumn> decoded = readBinaryFrame(buffer);
+		ASSERT_EQ(decoded.size(), 1);
+		ASSERT_EQ(decoded[0].type, 'd');
+		ASSERT_EQ(decoded[0].count, 4);
+		ASSERT_EQ(decoded[0].value<double>(0), 1.5);
+		ASSERT_EQ(decoded[0].value<double>(2), 3);
+		ASSERT_FALSE(decoded[0].isNA(0));
+		ASSERT_TRUE(decoded[0].isNA(1));
+		ASSERT_FALSE(decoded[0].isNA(3)); //NaN is a value, not NA
+		evbuffer_free(buffer);
+	}
+
+	TEST_F(VarTest, binaryDataFrame) {
+		EnvironmentWatcher watcher(Rcpp::Environment::global_env(), session->getExecCallback());
+		session->execScript("bdf <- data.frame(n=c(1L, NA, 3L), s=c('a', NA, 'ccc'), "
+			"f=factor(c('x', 'y', 'x')), b=c(TRUE, NA, FALSE), stringsAsFactors=FALSE)");
+		vector<RObject> columns;
+		json bdf = watcher.toJson("bdf", columns);
+		ASSERT_EQ(bdf["nrow"], 3);
+		ASSERT_EQ(bdf.count("rows"), 0);
+		ASSERT_EQ(bdf["binaryColumns"].size(), 4);
+		ASSERT_EQ(bdf["types"][2], "f");
+		ASSERT_EQ(bdf["f2"][0], "x");
+		ASSERT_EQ(bdf["f2"][1], "y");
+		struct evbuffer *buffer = evbuffer_new();
+		AppendBinaryColumnFrame(buffer, columns);
+		vector<BinaryColumn> decoded = readBinaryFrame(buffer);
+		ASSERT_EQ(decoded.size(), 4);
+		ASSERT_EQ(decoded[0].type, 'i');
+		ASSERT_EQ(decoded[0].value<int32_t>(2), 3);
+		ASSERT_TRUE(decoded[0].isNA(1));
+		ASSERT_EQ(decoded[1].type, 's');
+		ASSERT_EQ(decoded[1].stringValue(0), "a");
+		ASSERT_EQ(decoded[1].stringValue(2), "ccc");
+		ASSERT_TRUE(decoded[1].isNA(1));
+		ASSERT_EQ(decoded[2].type, 'i');
+		ASSERT_EQ(decoded[2].flags, 0);
+		ASSERT_EQ(decoded[2].value<int32_t>(0), 1);
+		ASSERT_EQ(decoded[2].value<int32_t>(1), 2);
+		ASSERT_EQ(decoded[3].type, 'b');
+		ASSERT_EQ(decoded[3].value<int32_t>(0), 1);
+		ASSERT_EQ(decoded[3].value<int32_t>(2), 0);
+		ASSERT_TRUE(decoded[3].isNA(1));
+		evbuffer_free(buffer);
+	}
+
+	TEST_F(VarTest, checkpointSkip) {
+		session->execScript("cpenv <- new.env(); evalq({ ca <- 1:10; cv <- runif(100000); cs <- 'x' }, cpenv)");
+		WorkspaceCheckpointer checkpointer(Rcpp::Environment::global_env().get("cpenv"));
+		vector<CheckpointVariable> changed;
+		vector<string> removed;
+		bool replace;
+		checkpointer.confirm(checkpointer.collectChanges(changed, removed, replace));
+		ASSERT_TRUE(replace);
+		ASSERT_EQ(checkpointNames(changed), (set<string>{"ca", "cv", "cs"}));
+		//an equal value isn't sent again
+		changed.clear();
+		session->execScript("evalq(ca <- 1:10, cpenv)");
+		checkpointer.confirm(checkpointer.collectChanges(changed, removed, replace));
+		ASSERT_FALSE(replace);
+		ASSERT_TRUE(changed.empty());
+		ASSERT_TRUE(removed.empty());
+		//a change outside the parts a sampled digest looks at
+		session->execScript("evalq({ cv[30001] <- 0; rm(cs) }, cpenv)");
+		checkpointer.confirm(checkpointer.collectChanges(changed, removed, replace));
+		ASSERT_FALSE(replace);
+		ASSERT_EQ(checkpointNames(changed), set<string>{"cv"});
+		ASSERT_EQ(removed, vector<string>{"cs"});
+	}
+
+	TEST_F(VarTest, checkpointReplace) {
+		session->execScript("cpenv <- new.env(); evalq({ ra <- 1; rb <- 'b' }, cpenv)");
+		WorkspaceCheckpointer checkpointer(Rcpp::Environment::global_env().get("cpenv"));
+		vector<CheckpointVariable> changed;
+		vector<string> removed;
+		bool replace;
+		checkpointer.collectChanges(changed, removed, replace);
+		ASSERT_TRUE(replace);
+		//the first wasn't confirmed, so the next one replaces it with every variable
+		changed.clear();
+		long generation = checkpointer.collectChanges(changed, removed, replace);
+		ASSERT_TRUE(replace);
+		ASSERT_EQ(checkpointNames(changed), (set<string>{"ra", "rb"}));
+		checkpointer.confirm(generation);
+		changed.clear();
+		checkpointer.confirm(checkpointer.collectChanges(changed, removed, replace));
+		ASSERT_FALSE(replace);
+		ASSERT_TRUE(changed.empty());
+		//saving .RData discards the stored checkpoint
+		checkpointer.invalidate();
+		checkpointer.collectChanges(changed, removed, replace);
+		ASSERT_TRUE(replace);
+		ASSERT_EQ(checkpointNames(changed), (set<string>{"ra", "rb"}));
+	}
+
+	TEST_F(VarTest, checkpointGeneration) {
+		session->execScript("cpenv <- new.env(); evalq(ga <- 1, cpenv)");
+		WorkspaceCheckpointer checkpointer(Rcpp::Environment::global_env().get("cpenv"));
+		vector<CheckpointVariable> changed;
+		vector<string> removed;
+		bool replace;
+		long first = checkpointer.collectChanges(changed, removed, replace);
+		session->execScript("evalq(ga <- 2, cpenv)");
+		long second = checkpointer.collectChanges(changed, removed, replace);
+		ASSERT_GT(second, first);
+		//an older checkpoint finishing doesn't mean the newer one did
+		checkpointer.confirm(first);
+		long third = checkpointer.collectChanges(changed, removed, replace);
+		ASSERT_TRUE(replace);
+		checkpointer.confirm(third);
+		changed.clear();
+		checkpointer.collectChanges(changed, removed, replace);
+		ASSERT_FALSE(replace);
+		ASSERT_TRUE(changed.empty());
+	}
+};